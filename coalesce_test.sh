@@ -0,0 +1,24 @@
+#!/bin/bash
+#
+# usage: coalesce_test.sh [compile flags]
+# e.g.   coalesce_test.sh -DCUSTODY=1
+#
+# Runs the DTN topology, whose messages are all small, without and with
+# coalescing of small messages (-DCOALESCE=1). Each line has the messages
+# generated and delivered, the frames transmitted and the average
+# delivery time, so the messages delivered per frame show the gain.
+#
+DURATION="5m"
+FLAGS="$1"
+RESULT=result.coalesce`echo "$FLAGS" | tr -cs 'A-Za-z0-9_' '.'`
+RESULT=${RESULT%.}
+#
+rm -f $RESULT
+#
+for c in 0 1
+do
+	sed "s/^\(compile[^\"]*\"\)/\1$FLAGS -DCOALESCE=$c /" DTN > DTN.flags
+	cnet -W -q -T -e $DURATION -s -Q DTN.flags	| 
+	echo $c `grep -E 'Messages *|Frames transmitted|Average delivery time' | cut -d: -f 2`
+	rm -f DTN.flags
+done > $RESULT
@@ -0,0 +1,162 @@
+/* this file compresses packet payloads with a small LZ77 
+ * compressor in the style of LZ4: greedy matching through a 
+ * hash table of 4 byte sequences, and byte aligned output, so
+ * that both directions are cheap enough to run on every packet.
+ *
+ * The output is a series of sequences, each of which is
+ *  - a token byte, the high nibble being the number of literals
+ *    and the low nibble the match length less MIN_MATCH. A nibble 
+ *    of 15 is followed by more length bytes, added up until one
+ *    is less than 255
+ *  - the literals
+ *  - a 2 byte little endian offset back to the match
+ * The last sequence has no offset, its literals run to the end.
+ *
+ * It does not depend on cnet, so it can also be benchmarked on
+ * its own (compress_bench.c).
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "compress.h"
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static uint32_t read32(const unsigned char * p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static int hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/*
+ * write a length that didn't fit in its nibble, 
+ * returns the new output position or -1 if out of room
+ */
+static int putLength(unsigned char * dst, int op, int cap, int n)
+{
+	for(; n >= 255; n -= 255)
+	{
+		if(op >= cap) return -1;
+		dst[op++] = 255;
+	}
+	if(op >= cap) return -1;
+	dst[op++] = n;
+	return op;
+}
+
+/*
+ * write a sequence of nlit literals from lit followed by a match 
+ * of mlen bytes at offset (none if mlen is 0), returns the new 
+ * output position or -1 if out of room
+ */
+static int putSequence(unsigned char * dst, int op, int cap,
+	const unsigned char * lit, int nlit, int offset, int mlen)
+{
+	int ml = mlen ? mlen - MIN_MATCH : 0;
+	if(op >= cap) return -1;
+	dst[op++] = ((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15);
+	if(nlit >= 15 && (op = putLength(dst, op, cap, nlit - 15)) < 0) 
+		return -1;
+	if(op + nlit > cap) return -1;
+	memcpy(dst + op, lit, nlit);
+	op += nlit;
+	if(mlen == 0) return op;
+
+	if(op + 2 > cap) return -1;
+	dst[op++] = offset & 0xff;
+	dst[op++] = offset >> 8;
+	if(ml >= 15 && (op = putLength(dst, op, cap, ml - 15)) < 0) 
+		return -1;
+	return op;
+}
+
+int lz_compress(const unsigned char * src, int len, 
+	unsigned char * dst, int cap)
+{
+	int table[1 << HASH_BITS];
+	for(int i=0;i<(1 << HASH_BITS);i++) table[i] = -1;
+
+	int ip = 0;
+	int anchor = 0;
+	int op = 0;
+	while(ip + MIN_MATCH <= len)
+	{
+		uint32_t seq = read32(src + ip);
+		int h = hash(seq);
+		int ref = table[h];
+		table[h] = ip;
+		if(ref < 0 || ip - ref > MAX_OFFSET || read32(src + ref) != seq)
+		{
+			ip++;
+			continue;
+		}
+
+		int mlen = MIN_MATCH;
+		while(ip + mlen < len && src[ref + mlen] == src[ip + mlen]) mlen++;
+		op = putSequence(dst, op, cap, src + anchor, ip - anchor, 
+			ip - ref, mlen);
+		if(op < 0) return 0;
+		ip += mlen;
+		anchor = ip;
+	}
+	op = putSequence(dst, op, cap, src + anchor, len - anchor, 0, 0);
+	return op < 0 ? 0 : op;
+}
+
+/*
+ * read a length continued past its nibble, 
+ * returns -1 if the input runs out
+ */
+static int getLength(const unsigned char * src, int * ip, int len, int n)
+{
+	int b;
+	do 
+	{
+		if(*ip >= len) return -1;
+		b = src[(*ip)++];
+		n += b;
+	} while(b == 255);
+	return n;
+}
+
+int lz_decompress(const unsigned char * src, int len, 
+	unsigned char * dst, int cap)
+{
+	int ip = 0;
+	int op = 0;
+	while(ip < len)
+	{
+		int token = src[ip++];
+		int nlit = token >> 4;
+		if(nlit == 15 && (nlit = getLength(src, &ip, len, nlit)) < 0) 
+			return -1;
+		if(ip + nlit > len || op + nlit > cap) return -1;
+		memcpy(dst + op, src + ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if(ip == len) break;
+
+		if(ip + 2 > len) return -1;
+		int offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		int mlen = token & 15;
+		if(mlen == 15 && (mlen = getLength(src, &ip, len, mlen)) < 0) 
+			return -1;
+		mlen += MIN_MATCH;
+		if(offset == 0 || offset > op || op + mlen > cap) return -1;
+
+		/*
+		 * byte by byte, as the match may overlap its own output
+		 */
+		for(int i=0;i<mlen;i++,op++) dst[op] = dst[op - offset];
+	}
+	return op;
+}
@@ -0,0 +1,13 @@
+/* 
+ * fast LZ77 compression of packet payloads (compress.c)
+ */
+
+//  COMPRESS len BYTES FROM src INTO AT MOST cap BYTES AT dst
+//  RETURNS THE COMPRESSED LENGTH, OR 0 IF IT DOESN'T FIT
+extern	int	lz_compress(const unsigned char *src, int len,
+			unsigned char *dst, int cap);
+
+//  DECOMPRESS len BYTES FROM src INTO AT MOST cap BYTES AT dst
+//  RETURNS THE DECOMPRESSED LENGTH, OR -1 IF THE INPUT IS CORRUPT
+extern	int	lz_decompress(const unsigned char *src, int len,
+			unsigned char *dst, int cap);
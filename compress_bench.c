@@ -0,0 +1,147 @@
+/* benchmark for compress.c on realistic packet payloads.
+ *
+ * The fake application (fakeapp.c) sends random bytes, which can't
+ * be compressed at all. Real DTN traffic is mostly text and records,
+ * so this generates payloads of a few kinds, splits them into 
+ * fragment sized chunks as the transport layer does, and reports the
+ * compression ratio and speed for each kind.
+ *
+ *	cc -O2 -o compress_bench compress_bench.c compress.c
+ *	./compress_bench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compress.h"
+
+#define CHUNK 2000	/* about MAX_FRAGMENT_SIZE */
+#define TOTAL (4 * 1024 * 1024)
+
+static const char * words[] = {
+	"the", "node", "message", "delivered", "campus", "library", "at",
+	"walking", "towards", "buffer", "and", "of", "is", "meeting", 
+	"tomorrow", "please", "bring", "notes", "lecture", "room", "to",
+	"in", "a", "for", "network", "report", "week", "assignment"
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+/*
+ * chat style english text
+ */
+static int gen_text(char * p, int len)
+{
+	int n = 0;
+	while(n < len - 16)
+	{
+		n += sprintf(p + n, "%s ", words[rand() % NWORDS]);
+		if(rand() % 12 == 0) n += sprintf(p + n, ".\n");
+	}
+	return n;
+}
+
+/*
+ * CSV sensor readings
+ */
+static int gen_csv(char * p, int len)
+{
+	int n = 0;
+	static int t = 1000000;
+	while(n < len - 64)
+	{
+		t += rand() % 5;
+		n += sprintf(p + n, "%d,node%02d,%d,%d,%.1f,%.2f\n", t, rand() % 16,
+			rand() % 135, rand() % 110, 20 + (rand() % 100) / 10.0,
+			(rand() % 1000) / 1000.0);
+	}
+	return n;
+}
+
+/*
+ * JSON log records
+ */
+static int gen_json(char * p, int len)
+{
+	int n = 0;
+	static int id = 0;
+	while(n < len - 128)
+	{
+		n += sprintf(p + n, "{\"id\":%d,\"src\":%d,\"dst\":%d,"
+			"\"event\":\"%s\",\"ok\":%s}\n", id++, rand() % 16, rand() % 16,
+			words[rand() % NWORDS], rand() % 4 ? "true" : "false");
+	}
+	return n;
+}
+
+/*
+ * random bytes, as produce_filth makes
+ */
+static int gen_random(char * p, int len)
+{
+	for(int i=0;i<len;i++) p[i] = rand();
+	return len;
+}
+
+static double seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char * name, int (*gen)(char *, int))
+{
+	char * in = malloc(TOTAL + CHUNK);
+	unsigned char * out = malloc(TOTAL + CHUNK);
+	int * clen = malloc(sizeof(int) * (TOTAL / CHUNK + 1));
+	unsigned char back[CHUNK];
+	int len = 0;
+	while(len < TOTAL) len += gen(in + len, CHUNK);
+	int nchunks = len / CHUNK;
+
+	/*
+	 * chunks that don't shrink are sent raw, as the network layer does
+	 */
+	double t0 = seconds();
+	long packed = 0;
+	int raw = 0;
+	for(int i=0;i<nchunks;i++)
+	{
+		clen[i] = lz_compress((unsigned char *)in + i * CHUNK, CHUNK, 
+			out + i * CHUNK, CHUNK - 1);
+		if(clen[i] == 0) raw++;
+		packed += clen[i] ? clen[i] : CHUNK;
+	}
+	double t1 = seconds();
+	for(int i=0;i<nchunks;i++)
+	{
+		if(clen[i] == 0) continue;
+		int n = lz_decompress(out + i * CHUNK, clen[i], back, CHUNK);
+		if(n != CHUNK || memcmp(back, in + i * CHUNK, CHUNK) != 0)
+		{
+			printf("%s: chunk %d did not survive a round trip\n", name, i);
+			exit(1);
+		}
+	}
+	double t2 = seconds();
+
+	double mb = (double)nchunks * CHUNK / 1e6;
+	double mbPacked = (double)(nchunks - raw) * CHUNK / 1e6;
+	printf("%-8s ratio %5.2f  raw chunks %5d/%d  compress %7.1f MB/s  "
+		"decompress %7.1f MB/s\n", name, (double)nchunks * CHUNK / packed,
+		raw, nchunks, mb / (t1 - t0), mbPacked / (t2 - t1));
+	free(in);
+	free(out);
+	free(clen);
+}
+
+int main()
+{
+	srand(1);
+	bench("text", gen_text);
+	bench("csv", gen_csv);
+	bench("json", gen_json);
+	bench("random", gen_random);
+	return 0;
+}
@@ -1,13 +1,24 @@
 #!/bin/bash
 #
+# usage: density_test.sh [compile flags]
+# e.g.   density_test.sh -DROUTING=ROUTE_EPIDEMIC
+#
 DURATION="5m"
+FLAGS="$1"
+RESULT=result.density`echo "$FLAGS" | tr -cs 'A-Za-z0-9_' '.'`
+RESULT=${RESULT%.}
 #
-rm -f result.density
+rm -f $RESULT
 #
 for f in 1 2 3 4 5 6 7 8
 do
-	cnet -W -q -T -e $DURATION -s -Q DENSITY/DTNDENS$f	| 
-	echo `expr $f + 1` `grep 'Messages *' | cut -d: -f 2`
-done > result.density
-
-
+	TOPOLOGY=DENSITY/DTNDENS$f
+	if [ -n "$FLAGS" ]
+	then
+		sed "s/^\(compile[^\"]*\"\)/\1$FLAGS /" $TOPOLOGY > $TOPOLOGY.flags
+		TOPOLOGY=$TOPOLOGY.flags
+	fi
+	cnet -W -q -T -e $DURATION -s -Q $TOPOLOGY	| 
+	echo `expr $f + 1` `grep -E 'Messages *|Frames transmitted' | cut -d: -f 2`
+	rm -f DENSITY/DTNDENS$f.flags
+done > $RESULT
@@ -14,8 +14,29 @@
 #define	EV_TALKING		EV_TIMER8
 #define MAXMESSAGE nodeinfo.maxmessagesize
 
+/*
+ * while the application is held back, check every second
+ * whether it may go again
+ */
+#define	FLOW_CHECK		1000000
+#define	EV_FLOW			EV_TIMER5
+
+/*
+ * messages of up to PRIO_HIGH_SIZE bytes are taken to be urgent and
+ * those over PRIO_LOW_SIZE bytes bulk, the rest are normal. Each class
+ * is given up on after its lifetime, in microseconds
+ */
+#define PRIO_HIGH_SIZE		1000
+#define PRIO_LOW_SIZE		4000
+static const CnetTime lifetime[NUM_PRIOS] = { 60000000, 120000000, 300000000 };
+
 static WLANRESULT my_WLAN_model(WLANSIGNAL *sig);
 
+/*
+ * false while the application is held back by flow control
+ */
+static bool app_enabled;
+
 EVENT_HANDLER(start_sending)
 {
 
@@ -27,13 +48,57 @@ void message_receive(char* data, int len, CnetAddr sender)
 		CHECK(CNET_write_application(data, &msglen));
 }
 
+/*
+ * Hold the application back while the network layer is congested.
+ * shed says the network layer has just shed some of our messages
+ */
+static void flow_control(bool shed)
+{
+		if(app_enabled && (shed || net_congested(false)))
+		{
+				CHECK(CNET_disable_application(ALLNODES));
+				app_enabled = false;
+				CNET_start_timer(EV_FLOW, FLOW_CHECK, 0);
+		}
+}
+
+EVENT_HANDLER(flow_check)
+{
+		if(net_congested(true))
+		{
+				CNET_start_timer(EV_FLOW, FLOW_CHECK, 0);
+				return;
+		}
+		CHECK(CNET_enable_application(ALLNODES));
+		app_enabled = true;
+}
+
+/*
+ * Messages are read into the heap, as with STREAM they may be far
+ * larger than fits on the stack
+ */
 EVENT_HANDLER(app_rdy)
 {
-		char msg[MAXMESSAGE];
+		char* msg = malloc(MAXMESSAGE);
 		int dest;
 		size_t len = MAXMESSAGE;
-		CHECK(CNET_read_application(&dest, &msg, &len));
-		transport_datagram(msg, len, dest);
+		CHECK(CNET_read_application(&dest, msg, &len));
+		int prio = PRIO_NORMAL;
+		if(len <= PRIO_HIGH_SIZE)
+				prio = PRIO_HIGH;
+		else if(len > PRIO_LOW_SIZE)
+				prio = PRIO_LOW;
+		bool kept = transport_datagram(msg, len, dest, prio, 
+			nodeinfo.time_in_usec + lifetime[prio]);
+		free(msg);
+		flow_control(!kept);
+}
+
+EVENT_HANDLER(shutdown_node)
+{
+		net_report();
+		transport_report();
+		oracle_report();
 }
 
 EVENT_HANDLER(reboot_node)
@@ -63,6 +128,8 @@ EVENT_HANDLER(reboot_node)
 
 				CHECK(CNET_set_handler(EV_APPLICATIONREADY, app_rdy, 0));
 				CHECK(CNET_set_handler(EV_TIMER6, start_sending, 0));
+				CHECK(CNET_set_handler(EV_SHUTDOWN, shutdown_node, 0));
+				CHECK(CNET_set_handler(EV_FLOW, flow_check, 0));
 
 				/*
 				 * START LAYERS
@@ -84,6 +151,7 @@ EVENT_HANDLER(reboot_node)
 				CNET_set_wlan_model( my_WLAN_model );
 				CNET_start_timer(EV_TALKING, TALK_FREQUENCY, 0);
 				CHECK(CNET_enable_application(ALLNODES));
+				app_enabled = true;
 				CNET_start_timer(EV_TIMER6, 10*ORACLEINTERVAL, 0);
 		}
 }
@@ -5,9 +5,91 @@
 #include <assert.h>
 
 /* some constants here, such as maximum frame lengths */
-#define ORACLEINTERVAL 3000000 /* oracle broadcast interval in microseconds */
-#define ORACLEWAIT (ORACLEINTERVAL*2) /* time a neighbour will be 'live' after a beacon */
+#define ORACLEINTERVAL 3000000 /* nominal oracle broadcast interval in microseconds, see oracle.c */
+#define ORACLEWAIT (ORACLEINTERVAL*2) /* time a neighbour will be 'live' after a beacon, at the nominal interval */
 #define MINDIST 2
+
+/*
+ * Routing engines for the network layer. The default is the single-copy
+ * geographic rule. Another engine can be selected per topology by adding
+ * e.g. -DROUTING=ROUTE_SPRAY_WAIT to its compile line.
+ */
+#define ROUTE_GEOGRAPHIC 0
+#define ROUTE_SPRAY_WAIT 1
+#define ROUTE_EPIDEMIC 2
+#define ROUTE_PROPHET 3
+#define ROUTE_BACKPRESSURE 4
+
+#ifndef ROUTING
+#define ROUTING ROUTE_GEOGRAPHIC
+#endif
+
+/*
+ * Custody transfer in the network layer, enabled with -DCUSTODY=1
+ */
+#ifndef CUSTODY
+#define CUSTODY 0
+#endif
+
+/*
+ * On-disk store for the network buffers, enabled with -DSTORE=1
+ */
+#ifndef STORE
+#define STORE 0
+#endif
+#define STORE_SEGMENT_SIZE (4*1024*1024)
+#define STORE_MAX_SEGMENTS 16
+
+/*
+ * Compression of buffered packets, enabled with -DCOMPRESS=1
+ */
+#ifndef COMPRESS
+#define COMPRESS 0
+#endif
+
+/*
+ * Retransmission of lost fragments by the source on a NACK from the
+ * destination, enabled with -DRELIABLE=1
+ */
+#ifndef RELIABLE
+#define RELIABLE 0
+#endif
+
+/*
+ * Erasure coding of messages in the transport layer: -DFEC=25 adds
+ * parity fragments worth about 25% of the data fragments, more for 
+ * small messages and less for large ones (see fec_tiers in transport.c)
+ */
+#ifndef FEC
+#define FEC 0
+#endif
+
+/*
+ * Streaming of large messages in the transport layer, enabled with
+ * -DSTREAM=1: they are sent a window of fragments at a time and the
+ * destination spools them to disk
+ */
+#ifndef STREAM
+#define STREAM 0
+#endif
+
+/*
+ * Coalescing of small messages for the same destination into one
+ * datagram in the transport layer, enabled with -DCOALESCE=1
+ */
+#ifndef COALESCE
+#define COALESCE 0
+#endif
+
+/*
+ * Message classes, most important first. Packets of a more important
+ * class are sent before, and shed after, those of the less important
+ * ones. A deadline of 0 means the message never expires.
+ */
+#define PRIO_HIGH 0
+#define PRIO_NORMAL 1
+#define PRIO_LOW 2
+#define NUM_PRIOS 3
 /* This is the maximum size of the PAYLOAD of a datagram, not the datagram including the header! */
 
 #define MAX_FRAME_SIZE WLAN_MAXDATA /* TODO: What is this actually? All other max sizes are based on this. */
@@ -31,20 +113,51 @@ typedef struct
 #define FRAME_HEADER_SIZE sizeof(FRAMEHEADER)
 #define MAX_PACKET_SIZE (MAX_FRAME_SIZE - FRAME_HEADER_SIZE)
 
+typedef enum
+{
+	NET_DATA, NET_SUMMARY, NET_CUSTODY_ACK, NET_CUSTODY_REFUSE
+} NETTYPE;
+
 /* 
  * network packet structure 
  */
 typedef struct 
 {
+	NETTYPE type;
 	CnetAddr source;
 	CnetAddr dest;
+	/*
+	 * serial number given by the source, (source, seq) identifies
+	 * a packet (bundle) throughout the network
+	 */
+	int seq;
 	/*
 	 * length of msg 
 	 */
 	int len;
+	/*
+	 * number of copies this carrier may still hand out (spray and wait),
+	 * always 1 for single-copy routing
+	 */
+	int copies;
+	/*
+	 * PACKET_* flags
+	 */
+	int flags;
+	/*
+	 * class of the packet, PRIO_*, and the time after which
+	 * it is dropped rather than delivered
+	 */
+	int prio;
+	CnetTime deadline;
 
 } PACKETHEADER;
 
+/* msg is compressed, and is decompressed by the destination */
+#define PACKET_COMPRESSED 1
+/* msg did not compress, don't try again */
+#define PACKET_INCOMPRESSIBLE 2
+
 /* These are used by the network layer */
 #define PACKET_HEADER_SIZE (sizeof(PACKETHEADER))
 #define MAX_DATAGRAM_SIZE (MAX_PACKET_SIZE - PACKET_HEADER_SIZE) 
@@ -54,6 +167,15 @@ typedef struct {
 	char msg[MAX_DATAGRAM_SIZE];
 } PACKET;
 
+/*
+ * one piece of a message handed to net_sendv, which
+ * joins the pieces into a single packet
+ */
+typedef struct {
+	char * base;
+	int len;
+} NETVEC;
+
 /*
  **************************************************
  * The datagram structure.			  *
@@ -70,9 +192,30 @@ typedef struct {
  * then added to this header before they are sent
  * to the network layer.
  */
+typedef enum
+{
+	/* a fragment of a message */
+	DG_DATA,
+	/* 
+	 * the bitmap of the fragments of a message still missing at its 
+	 * destination, sent back to its source (RELIABLE)
+	 */
+	DG_NACK,
+	/* a fragment of a streamed message (STREAM) */
+	DG_STREAM,
+	/*
+	 * the number of fragments of a streamed message received in 
+	 * order by its destination, sent back to its source (STREAM)
+	 */
+	DG_PROGRESS,
+	/* several small messages for the same destination (COALESCE) */
+	DG_BATCH
+} DATAGRAMTYPE;
+
 typedef struct
 {
 	uint32_t checksum;
+	DATAGRAMTYPE type;
 	/* the size of msg_frag */
 	uint32_t msg_size;
 	/* the original sender */
@@ -83,6 +226,13 @@ typedef struct
 	int frag_num;
 	/* the number of fragments in this message */
 	int frag_count;
+	/* the length of the whole message */
+	int msg_len;
+	/* the class of the message, PRIO_* */
+	int prio;
+	/* when the message was sent, and when it expires */
+	CnetTime created;
+	CnetTime deadline;
 } DATAGRAMHEADER;
 
 /* These are used by the transport layer */
@@ -102,27 +252,46 @@ typedef struct
 /* link.c */
 
 int get_nbytes_writeable();
-void link_send_data( char * msg, int len, CnetAddr recv);
+void link_send_data( char * msg, int len, CnetAddr recv, int prio);
 void link_send_info( char * msg, int len, CnetAddr recv);
+int link_queued(CnetAddr recv);
 void link_init();
 
 /* network.c */
 int get_public_nbytes_free();
 int get_private_nbytes_free();
-bool net_send( char * msg, int len, CnetAddr dst);
+int net_backlog(CnetAddr dest);
+bool net_congested(bool stopped);
+bool net_send( char * msg, int len, CnetAddr dst, int prio, CnetTime deadline);
+bool net_sendv( NETVEC * vec, int count, CnetAddr dst, int prio, 
+	CnetTime deadline);
 void net_recv( char * msg, int len, CnetAddr dst);
 void net_init();
 void net_send_buffered();
+void net_neighbour_up(CnetAddr nb);
+void net_report();
 
 /* oracle.c */
 bool get_nth_best_node(CnetAddr * ptr, int n, CnetAddr dest, size_t messageSize);
+bool is_good_carrier(CnetAddr via, CnetAddr dest, size_t messageSize);
+int get_neighbour_nbytes_free();
 void oracle_recv(char * msg, int len, CnetAddr rcv);
 void oracle_init();
+void oracle_report();
+
+/* store.c */
+PACKET * store_put(PACKET * pack);
+bool store_owns(PACKET * pack);
+void store_release(PACKET * pack);
+void store_init(bool recover, void (*admit)(PACKET * pack),
+	void (*moved)(PACKET * from, PACKET * to));
 
 /* transport.c */
 void transport_recv(char * msg, int len, CnetAddr sender);
-void transport_datagram(char * msg, int len, CnetAddr destination);
+bool transport_datagram(char * msg, int len, CnetAddr destination, int prio,
+	CnetTime deadline);
 void transport_init();
+void transport_report();
 
 /* fakeapp.c */
 void generate_message();
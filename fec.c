@@ -0,0 +1,170 @@
+/* this file makes and uses Reed-Solomon erasure codes over GF(256),
+ * so that a message split into k data blocks can be rebuilt from 
+ * any k of the n blocks sent.
+ *
+ * The code is systematic: blocks 0..k-1 are the data itself and 
+ * blocks k..n-1 are parity. Parity block x is the sum over the data
+ * blocks i of data[i] / (x + i), i.e. the generator matrix is the 
+ * identity on top of a Cauchy matrix. Every square submatrix of a 
+ * Cauchy matrix is invertible, so any k rows of the generator are.
+ *
+ * Decoding takes the first k blocks which arrived, inverts their 
+ * rows of the generator, and rebuilds only the missing data blocks.
+ *
+ * It does not depend on cnet, so it can also be benchmarked on
+ * its own (fec_bench.c).
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "fec.h"
+
+/* x^8 + x^4 + x^3 + x^2 + 1 */
+#define GF_POLY 0x11d
+
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+
+static unsigned char gf_mul(unsigned char a, unsigned char b)
+{
+	if(a == 0 || b == 0) return 0;
+	return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static unsigned char gf_inv(unsigned char a)
+{
+	return gf_exp[255 - gf_log[a]];
+}
+
+/*
+ * dst += c * src over len bytes
+ */
+static void mul_add(unsigned char * dst, const unsigned char * src, 
+	unsigned char c, int len)
+{
+	if(c == 0) return;
+	const unsigned char * row = gf_exp + gf_log[c];
+	for(int i=0;i<len;i++)
+	{
+		if(src[i] != 0) dst[i] ^= row[gf_log[src[i]]];
+	}
+}
+
+/*
+ * element (row, col) of the generator matrix for k data blocks
+ */
+static unsigned char generator(int row, int col, int k)
+{
+	if(row < k) return row == col;
+	return gf_inv(row ^ col);
+}
+
+void fec_init(void)
+{
+	int x = 1;
+	for(int i=0;i<255;i++)
+	{
+		gf_exp[i] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if(x & 0x100) x ^= GF_POLY;
+	}
+	for(int i=255;i<512;i++) gf_exp[i] = gf_exp[i - 255];
+}
+
+void fec_encode(unsigned char ** data, int k, int index, 
+	unsigned char * out, int len)
+{
+	memset(out, 0, len);
+	for(int i=0;i<k;i++)
+	{
+		mul_add(out, data[i], generator(index, i, k), len);
+	}
+}
+
+/*
+ * invert the k x k matrix m in place by Gauss-Jordan elimination,
+ * returns false if it is singular
+ */
+static bool invert(unsigned char * m, int k)
+{
+	static unsigned char inv[FEC_MAX_BLOCKS * FEC_MAX_BLOCKS];
+	memset(inv, 0, k * k);
+	for(int i=0;i<k;i++) inv[i * k + i] = 1;
+
+	for(int col=0;col<k;col++)
+	{
+		int pivot = col;
+		while(pivot < k && m[pivot * k + col] == 0) pivot++;
+		if(pivot == k) return false;
+		if(pivot != col)
+		{
+			for(int j=0;j<k;j++)
+			{
+				unsigned char t = m[col * k + j];
+				m[col * k + j] = m[pivot * k + j];
+				m[pivot * k + j] = t;
+				t = inv[col * k + j];
+				inv[col * k + j] = inv[pivot * k + j];
+				inv[pivot * k + j] = t;
+			}
+		}
+		unsigned char c = gf_inv(m[col * k + col]);
+		for(int j=0;j<k;j++)
+		{
+			m[col * k + j] = gf_mul(m[col * k + j], c);
+			inv[col * k + j] = gf_mul(inv[col * k + j], c);
+		}
+		for(int r=0;r<k;r++)
+		{
+			unsigned char f = m[r * k + col];
+			if(r == col || f == 0) continue;
+			for(int j=0;j<k;j++)
+			{
+				m[r * k + j] ^= gf_mul(f, m[col * k + j]);
+				inv[r * k + j] ^= gf_mul(f, inv[col * k + j]);
+			}
+		}
+	}
+	memcpy(m, inv, k * k);
+	return true;
+}
+
+bool fec_decode(unsigned char ** block, const bool * have, 
+	int k, int n, int len)
+{
+	/*
+	 * the first k blocks which arrived, and their rows
+	 */
+	int used[FEC_MAX_BLOCKS];
+	int nused = 0;
+	bool missing = false;
+	for(int i=0;i<n && nused<k;i++)
+	{
+		if(have[i]) used[nused++] = i;
+		else if(i < k) missing = true;
+	}
+	if(nused < k) return false;
+	if(!missing) return true;
+
+	static unsigned char m[FEC_MAX_BLOCKS * FEC_MAX_BLOCKS];
+	for(int r=0;r<k;r++)
+	{
+		for(int c=0;c<k;c++) m[r * k + c] = generator(used[r], c, k);
+	}
+	if(!invert(m, k)) return false;
+
+	/*
+	 * data block i is row i of the inverse times the blocks used
+	 */
+	for(int i=0;i<k;i++)
+	{
+		if(have[i]) continue;
+		memset(block[i], 0, len);
+		for(int r=0;r<k;r++)
+		{
+			mul_add(block[i], block[used[r]], m[i * k + r], len);
+		}
+	}
+	return true;
+}
@@ -0,0 +1,21 @@
+/* 
+ * Reed-Solomon erasure coding of message fragments (fec.c)
+ */
+#include <stdbool.h>
+
+//  THE MOST BLOCKS, DATA AND PARITY TOGETHER, IN ONE CODE
+#define	FEC_MAX_BLOCKS	256
+
+//  FILL IN THE GF(256) TABLES, BEFORE ANY OTHER CALL
+extern	void	fec_init(void);
+
+//  MAKE PARITY BLOCK index (k <= index < FEC_MAX_BLOCKS) OF THE k DATA
+//  BLOCKS OF len BYTES AT data[0..k-1], INTO out
+extern	void	fec_encode(unsigned char **data, int k, int index,
+			unsigned char *out, int len);
+
+//  REBUILD THE MISSING DATA BLOCKS OF A CODE OF n BLOCKS OF len BYTES.
+//  block[i] POINTS TO BLOCK i AND have[i] SAYS WHETHER IT ARRIVED. AT LEAST
+//  k MUST HAVE ARRIVED. RETURNS false IF THE DATA CAN'T BE REBUILT
+extern	bool	fec_decode(unsigned char **block, const bool *have,
+			int k, int n, int len);
@@ -1,13 +1,26 @@
 #!/bin/bash
 #
+# usage: freq_test.sh [compile flags]
+# e.g.   freq_test.sh -DROUTING=ROUTE_BACKPRESSURE
+#
 DURATION="5m"
+FLAGS="$1"
+RESULT=result.freq`echo "$FLAGS" | tr -cs 'A-Za-z0-9_' '.'`
+RESULT=${RESULT%.}
 #
-rm -f result.freq
+rm -f $RESULT
 #
 for f in 0 1 2 3 4 5 6 7 8 9
 do
-	cnet -W -q -T -e $DURATION -s -Q MESSAGEFREQ/FREQ$f	| 
+	TOPOLOGY=MESSAGEFREQ/FREQ$f
+	if [ -n "$FLAGS" ]
+	then
+		sed "s/^\(compile[^\"]*\"\)/\1$FLAGS /" $TOPOLOGY > $TOPOLOGY.flags
+		TOPOLOGY=$TOPOLOGY.flags
+	fi
+	cnet -W -q -T -e $DURATION -s -Q $TOPOLOGY	| 
 	echo $[10 - $f] `grep 'Messages *' | cut -d: -f 2`
-done > result.freq
+	rm -f MESSAGEFREQ/FREQ$f.flags
+done > $RESULT
 
 
@@ -1,6 +1,7 @@
 /* this file handles data link layer functions, including:
  *  - CSMA/CA with binary exponential backoff
- *  - buffers and retries data to be sent
+ *  - buffers and retries data to be sent, the frames of the more
+ *    important classes (PRIO_*) first
  *  - passes received data frames to the appropriate handlers
  *  - manages address resolution and maintains an address resolution cache
  */
@@ -36,6 +37,8 @@ typedef struct
 struct node
 {
 	FRAME f;
+	/* class of the frame, PRIO_* */
+	int prio;
 	struct node* next;
 };
 
@@ -88,22 +91,41 @@ static int numTimeouts = 0;
  */
 
 /*
- * Place a frame on the queue
+ * Place a frame of class prio on the queue, behind all frames of the
+ * same or a more important class. The head is never overtaken while 
+ * it is being sent
  */
-int enqueue(struct queue* q, FRAME f)
+int enqueue(struct queue* q, FRAME f, int prio)
 {
 	struct node* n = malloc(sizeof(struct node));
 	n->f = f;
+	n->prio = prio;
+	n->next = NULL;
 	if (q->head == NULL)
 	{
 		q->head = q->tail = n;
+		return 0;
 	}
-	else 
+
+	struct node* prev = NULL;
+	struct node* e = q->head;
+	if(sending_data)
 	{
-		q->tail->next = n;
-		q->tail = n;
+		prev = e;
+		e = e->next;
 	}
-	n->next = NULL;
+	while(e != NULL && e->prio <= prio)
+	{
+		prev = e;
+		e = e->next;
+	}
+	n->next = e;
+	if(prev == NULL)
+		q->head = n;
+	else
+		prev->next = n;
+	if(e == NULL)
+		q->tail = n;
 	return 0;
 }
 
@@ -188,9 +210,9 @@ void send_frame(FRAMETYPE type, CnetAddr dest, size_t len, char* data)
 }
 
 /*
- * send data msg of length len to receiver recv 
+ * send data msg of length len and class prio to receiver recv 
  */
-void link_send_data( char* msg, int len, CnetAddr recv) 
+void link_send_data( char* msg, int len, CnetAddr recv, int prio) 
 {
 	FRAME f;
 	f.h.type = DL_DATA;
@@ -198,7 +220,20 @@ void link_send_data( char* msg, int len, CnetAddr recv)
 	f.h.src = nodeinfo.nodenumber;
 	f.h.len = len;
 	memcpy(f.msg, msg, len);
-	enqueue(buf, f);
+	enqueue(buf, f, prio);
+}
+
+/*
+ * number of data frames waiting to be sent to recv
+ */
+int link_queued(CnetAddr recv)
+{
+	int n = 0;
+	for(struct node* e = buf->head; e != NULL; e = e->next)
+	{
+		if(e->f.h.dest == recv) n++;
+	}
+	return n;
 }
 
 /* send info msg of length len to receiver recv
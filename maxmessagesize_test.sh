@@ -1,13 +1,26 @@
 #!/bin/bash
 #
+# usage: maxmessagesize_test.sh [compile flags]
+# e.g.   maxmessagesize_test.sh -DFEC=25
+#
+# DTNMESS10 to DTNMESS12 go past 10000 bytes, for -DSTREAM=1
+#
 DURATION="5m"
+FLAGS="$1"
+RESULT=result.messagesize`echo "$FLAGS" | tr -cs 'A-Za-z0-9_' '.'`
+RESULT=${RESULT%.}
 #
-rm -f result.messagesize
+rm -f $RESULT
 #
-for f in 0 1 2 3 4 5 6 7 8 9
+for f in 0 1 2 3 4 5 6 7 8 9 10 11 12
 do
-	cnet -W -q -T -e $DURATION -s -Q MESSAGESIZE/DTNMESS$f	| 
-	echo $[1000 + $f*1000] `grep 'Messages *' | cut -d: -f 2`
-done > result.messagesize
-
-
+	TOPOLOGY=MESSAGESIZE/DTNMESS$f
+	if [ -n "$FLAGS" ]
+	then
+		sed "s/^\(compile[^\"]*\"\)/\1$FLAGS /" $TOPOLOGY > $TOPOLOGY.flags
+		TOPOLOGY=$TOPOLOGY.flags
+	fi
+	cnet -W -q -T -e $DURATION -s -Q $TOPOLOGY	| 
+	echo `grep '^maxmessagesize' MESSAGESIZE/DTNMESS$f | tr -dc '0-9'` `grep 'Messages *' | cut -d: -f 2`
+	rm -f MESSAGESIZE/DTNMESS$f.flags
+done > $RESULT
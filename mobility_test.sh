@@ -1,13 +1,26 @@
 #!/bin/bash
 #
+# usage: mobility_test.sh [compile flags]
+# e.g.   mobility_test.sh -DROUTING=ROUTE_SPRAY_WAIT
+#
 DURATION="5m"
+FLAGS="$1"
+RESULT=result.mobility`echo "$FLAGS" | tr -cs 'A-Za-z0-9_' '.'`
+RESULT=${RESULT%.}
 #
-rm -f result.mobility
+rm -f $RESULT
 #
 for f in 0 1 2 3 4 5 6 7 8 9
 do
-	cnet -W -q -T -e $DURATION -s -Q MOBILITY/MOBILITY$f	| 
-	echo $[10 + $f*20] `grep 'Messages *' | cut -d: -f 2`
-done > result.mobility
+	TOPOLOGY=MOBILITY/MOBILITY$f
+	if [ -n "$FLAGS" ]
+	then
+		sed "s/^\(compile[^\"]*\"\)/\1$FLAGS /" $TOPOLOGY > $TOPOLOGY.flags
+		TOPOLOGY=$TOPOLOGY.flags
+	fi
+	cnet -W -q -T -e $DURATION -s -Q $TOPOLOGY	| 
+	echo $[10 + $f*20] `grep -E 'Messages *|Average delivery time' | cut -d: -f 2`
+	rm -f MOBILITY/MOBILITY$f.flags
+done > $RESULT
 
 
@@ -10,11 +10,137 @@
  *    monopolise the reosurces of this host. Two packet
  *    queues should be maintained, one for data originating
  *    from this host, and one for data from other hosts.
+ *
+ * Packets originating here are kept in the private buffer, all others
+ * in the public buffer. Only the space in the public buffer is offered
+ * to other nodes. No source may hold more than SOURCE_QUOTA bytes of
+ * the public buffer, and when it is full the oldest packets of the 
+ * source holding the most bytes are shed first.
+ *
+ * With ROUTING == ROUTE_SPRAY_WAIT the source hands out SPRAY_COPIES
+ * copy tokens per packet (binary spray and wait). On each new contact
+ * a carrier holding more than one token gives half of them to the
+ * neighbour, if the oracle considers it a good carrier. A carrier
+ * left with a single token only ever delivers directly. The 
+ * destination keeps only the first copy of a packet that reaches it.
+ *
+ * With ROUTING == ROUTE_EPIDEMIC every node keeps a copy of every packet
+ * it hears of. On a new contact both sides send a summary vector, a 
+ * Bloom filter of the packets they hold or have seen, and then send the
+ * peer only the packets that are missing from its summary. At most 
+ * EPIDEMIC_CONTACT_BYTES are sent per summary to bound the bandwidth.
+ *
+ * With ROUTING == ROUTE_BACKPRESSURE the bytes buffered here for each
+ * destination are kept (net_backlog), advertised in our beacons and 
+ * used by the oracle to forward down the backlog gradient.
+ *
+ * With STORE the buffered packets live in the on-disk store (store.c)
+ * rather than in memory, which lets the buffers grow much larger and
+ * keeps them across a reboot of the node.
+ *
+ * With COMPRESS the payload of a packet is compressed when it enters
+ * a buffer, so it takes up less space there. It stays compressed 
+ * until it reaches its destination, where it is decompressed before
+ * being passed up. Packets which don't get smaller are left alone.
+ *
+ * With CUSTODY a forwarded packet is not freed when it is handed to the
+ * link layer. It is kept on the pending stack until the next hop accepts
+ * custody of it. A refusal, or no answer within CUSTODY_TIMEOUT, moves 
+ * it back to the buffer, from where it is retransmitted or rerouted.
+ * A node refuses custody when it cannot hold the packet without 
+ * shedding load. The copy kept while waiting for custody never sheds
+ * other packets either: a packet without room for it stays buffered.
+ *
+ * The oracle ranks the next hop candidates for a packet. If the best
+ * one is busy (the link layer already has LINK_BUSY_FRAMES queued for
+ * it) or has recently refused or ignored a packet, the next one is 
+ * tried, up to NET_CANDIDATES of them, before the packet is buffered.
+ *
+ * net_congested tells the application layer when to hold back our own
+ * traffic: when the private buffer is getting full, when what is in it
+ * would take too long to drain at the rate our packets have recently 
+ * been handed on, or when it holds more than the best neighbour has
+ * room for. net_send returns false if any of our own packets had to be
+ * shed to take the new one.
+ *
+ * Every packet has a class (PRIO_*) and a deadline. Buffered packets are
+ * retried the most important class first, and load is shed from the
+ * least important class first; a packet is never shed to make room for
+ * a less important one. Packets past their deadline are dropped as soon
+ * as they are found, and shed before any others.
  */
 #include "dtn.h"
+#include "compress.h"
 
-/* The size of the buffer for this layer */
+/* 
+ * The size of the buffers for this layer. With the on-disk store half
+ * of it is left free for records that are dead but not compacted yet.
+ */
+#if STORE
+#define NETWORK_BUFF_SIZE (STORE_SEGMENT_SIZE * STORE_MAX_SEGMENTS / 2)
+#else
 #define NETWORK_BUFF_SIZE 1000000
+#endif
+#define PRIVATE_BUFF_SIZE (NETWORK_BUFF_SIZE / 4)
+
+/* most bytes of the public buffer that one source may hold */
+#define SOURCE_QUOTA (NETWORK_BUFF_SIZE / 4)
+
+/* the bytes a packet takes up in a buffer */
+#define MEM_USED(p) ((int)(sizeof(struct STACK_EL) + \
+	PACKET_HEADER_SIZE + (p)->h.len))
+
+/* copy tokens given to each packet by its source (spray and wait) */
+#define SPRAY_COPIES 8
+
+/* size of the summary vector Bloom filter and number of hash functions */
+#define SUMMARY_BYTES 1024
+#define SUMMARY_BITS (SUMMARY_BYTES * 8)
+#define SUMMARY_HASHES 4
+
+/* number of recently accepted packets remembered (epidemic) */
+#define SEEN_SIZE 1024
+
+/*
+ * usecs of uptime per serial number. A rebooted node starts its 
+ * serial numbers at the time, past the ones it used before as long
+ * as it sent no more than one packet per SEQ_TICK
+ */
+#define SEQ_TICK 1000
+
+/* most data sent in reply to one summary vector (epidemic) */
+#define EPIDEMIC_CONTACT_BYTES 65536
+
+/* time to wait for a custody decision before trying again */
+#define CUSTODY_TIMEOUT ORACLEWAIT
+
+/* next hop candidates tried before a packet is buffered */
+#define NET_CANDIDATES 3
+
+/* frames queued for a neighbour at which it counts as busy */
+#define LINK_BUSY_FRAMES 4
+
+/* how long a neighbour which refused or ignored a packet is avoided */
+#define FAIL_HOLDOFF ORACLEWAIT
+#define FAILED_SIZE 16
+
+/* 
+ * flow control: share of the private buffer in use at which our own
+ * traffic is held back. It is let through again once all of the
+ * limits are FLOW_RESUME of what they are to hold it back
+ */
+#define FLOW_STOP 0.75
+#define FLOW_RESUME 0.5
+
+/* own bytes always allowed, whatever the neighbours and drain rate */
+#define FLOW_MIN_WINDOW 65536
+
+/* longest time the private buffer may take to drain, in seconds */
+#define FLOW_MAX_DRAIN 60
+
+/* interval between samples of the drain rate, and weight of each */
+#define DRAIN_SAMPLE 1000000
+#define DRAIN_ALPHA 0.25
 
 /*
  ********************
@@ -28,6 +154,11 @@
 struct STACK_EL 
 {
 		PACKET* p;
+		/* 
+		 * next hop and time sent, for packets awaiting custody 
+		 */
+		CnetAddr hop;
+		CnetTime sent;
 		struct STACK_EL* down;
 		struct STACK_EL* up;
 };
@@ -53,8 +184,114 @@ typedef struct
  * ******************************
  */
 
+/*
+ * public buffer, for data from other hosts, and private buffer
+ * for data originating here, and the free space in each
+ */
 static int free_bytes;
 static STACK* buff;
+static int private_free_bytes;
+static STACK* own;
+
+/*
+ * bytes held per address
+ */
+struct ADDR_USE
+{
+		CnetAddr addr;
+		int bytes;
+};
+
+/*
+ * bytes of the public buffer held by each source
+ */
+static struct ADDR_USE* source_use;
+static int num_sources;
+
+/*
+ * bytes of both buffers waiting for each destination (backpressure)
+ */
+static struct ADDR_USE* dest_use;
+static int num_dests;
+
+/*
+ * packets sent but not yet accepted by the next hop (custody)
+ */
+static STACK* pending;
+
+/*
+ * packets being retried by net_send_buffered
+ */
+static STACK* retry;
+
+/*
+ * custody statistics for this node
+ */
+static struct
+{
+		/* custody we accepted */
+		int accepted;
+		/* custody we refused, for any reason */
+		int refused;
+		/* ... of which because our buffer was full */
+		int refused_full;
+		/* ... of which because the source was over its quota */
+		int refused_quota;
+		/* our packets accepted by the next hop */
+		int granted;
+		/* our packets refused by the next hop */
+		int denied;
+		/* our packets with no answer within CUSTODY_TIMEOUT */
+		int expired;
+} custody;
+
+/*
+ * Counter for the serial numbers of packets originating here
+ */
+static int seq_counter;
+
+/*
+ * ring of the (source, seq) of packets recently accepted, so that
+ * epidemic copies and custody retransmissions are not delivered twice
+ */
+static struct 
+{
+		CnetAddr source;
+		int seq;
+} seen[SEEN_SIZE];
+static int seen_next;
+static int seen_count;
+
+/*
+ * ring of the neighbours which recently refused or ignored 
+ * a packet, and until when they are avoided
+ */
+static struct
+{
+		CnetAddr hop;
+		CnetTime until;
+} failed[FAILED_SIZE];
+static int failed_next;
+
+/*
+ * own packets shed to make room, bytes of own packets handed on
+ * since the last sample, and the average rate at which they are 
+ * handed on in bytes per second (flow control)
+ */
+static int own_shed;
+static int drained;
+static double drain_rate;
+static CnetTime drain_sampled;
+
+/*
+ * packets of each class shed to make room, and dropped 
+ * because they were past their deadline
+ */
+static struct
+{
+		int shed;
+		int expired;
+} dropped[NUM_PRIOS];
 
 
 /*
@@ -64,13 +301,67 @@ static STACK* buff;
  */
 
 /*
- * Returns the amount of space in the buffer
+ * Returns the amount of space in the public buffer
  */
 int get_public_nbytes_free() 
 {
 		return free_bytes;
 }
 
+/*
+ * Returns the bytes buffered here for dest, which is our queue 
+ * length for it in the backpressure engine
+ */
+int net_backlog(CnetAddr dest)
+{
+		for(int i = 0; i < num_dests; i++)
+		{
+				if(dest_use[i].addr == dest)
+						return dest_use[i].bytes;
+		}
+		return 0;
+}
+
+/*
+ * Returns true if the application should hold back our own traffic.
+ * stopped says whether it is held back already, in which case the
+ * limits are lowered to FLOW_RESUME of what they are otherwise
+ */
+bool net_congested(bool stopped)
+{
+		CnetTime t = nodeinfo.time_in_usec;
+		if(t >= drain_sampled + DRAIN_SAMPLE)
+		{
+				double sample = drained * 1000000.0 / (t - drain_sampled);
+				drain_rate = (1 - DRAIN_ALPHA) * drain_rate + DRAIN_ALPHA * sample;
+				drained = 0;
+				drain_sampled = t;
+		}
+
+		double s = stopped ? FLOW_RESUME / FLOW_STOP : 1;
+		int used = PRIVATE_BUFF_SIZE - private_free_bytes;
+		if(used > s * FLOW_STOP * PRIVATE_BUFF_SIZE)
+				return true;
+		if(used <= s * FLOW_MIN_WINDOW)
+				return false;
+
+		/*
+		 * beyond the minimum window, the backlog must fit the best 
+		 * neighbour and drain in time
+		 */
+		if(used > s * get_neighbour_nbytes_free())
+				return true;
+		return used > s * FLOW_MAX_DRAIN * drain_rate;
+}
+
+/*
+ * Returns the amount of space in the private buffer
+ */
+int get_private_nbytes_free() 
+{
+		return private_free_bytes;
+}
+
 
 /*
  **********************************
@@ -78,6 +369,94 @@ int get_public_nbytes_free()
  **********************************
  */
 
+/*
+ * returns true if pack originated at this node, so belongs
+ * in the private buffer
+ */
+static bool is_own(PACKET* pack)
+{
+		return pack->h.source == nodeinfo.nodenumber;
+}
+
+/*
+ * free a packet, wherever it is held
+ */
+static void release(PACKET* pack)
+{
+		if(STORE && store_owns(pack))
+				store_release(pack);
+		else
+				free(pack);
+}
+
+/*
+ * returns true if pack is past its deadline
+ */
+static bool is_expired(PACKET* pack)
+{
+		return pack->h.deadline != 0 && pack->h.deadline < nodeinfo.time_in_usec;
+}
+
+/*
+ * drop a packet which is past its deadline or has to make room,
+ * and count it against its class
+ */
+static void drop(PACKET* pack)
+{
+		if(is_expired(pack))
+				dropped[pack->h.prio].expired++;
+		else
+				dropped[pack->h.prio].shed++;
+		release(pack);
+}
+
+/*
+ * returns the bytes held by addr in the table use of num entries,
+ * adding addr to the table if it's not there yet
+ */
+static int* bytes_in(struct ADDR_USE** use, int* num, CnetAddr addr)
+{
+		for(int i = 0; i < *num; i++)
+		{
+				if((*use)[i].addr == addr)
+						return &((*use)[i].bytes);
+		}
+		(*num)++;
+		*use = realloc(*use, *num * sizeof(struct ADDR_USE));
+		(*use)[*num - 1].addr = addr;
+		(*use)[*num - 1].bytes = 0;
+		return &((*use)[*num - 1].bytes);
+}
+
+/*
+ * returns the bytes of the public buffer held by source
+ */
+static int* bytes_of(CnetAddr source)
+{
+		return bytes_in(&source_use, &num_sources, source);
+}
+
+/*
+ * charge (sign 1) or refund (sign -1) the space for pack to the 
+ * buffer it belongs in. Packets are charged to their buffer 
+ * whichever stack they are on, so packets awaiting custody still
+ * take up space.
+ */
+static void charge(PACKET* pack, int sign)
+{
+		int mem_used = sign * MEM_USED(pack);
+		*bytes_in(&dest_use, &num_dests, pack->h.dest) += mem_used;
+		if(is_own(pack))
+		{
+				private_free_bytes -= mem_used;
+		}
+		else
+		{
+				free_bytes -= mem_used;
+				*bytes_of(pack->h.source) += mem_used;
+		}
+}
+
 /*
  * Creates a new stack
  */
@@ -100,28 +479,30 @@ static bool is_empty(STACK* s)
 
 
 /*
- * delete a packet from the bottom of the stack 
+ * Returns pack with its payload compressed, or pack itself if it
+ * is compressed already or doesn't get any smaller
  */
-static PACKET* dequeue(STACK* s) 
+static PACKET* compress_packet(PACKET* pack)
 {
-		if(is_empty(s)) 
-		{
-				return NULL;
-		}
-		else 
+		if(pack->h.flags & (PACKET_COMPRESSED | PACKET_INCOMPRESSIBLE))
+				return pack;
+		if(STORE && store_owns(pack))
+				return pack;
+
+		PACKET* c = malloc(PACKET_HEADER_SIZE + pack->h.len);
+		int len = lz_compress((unsigned char*) pack->msg, pack->h.len, 
+			(unsigned char*) c->msg, pack->h.len - 1);
+		if(len == 0)
 		{
-				struct STACK_EL* del = s->bottom;
-				PACKET* tmp = del->p;
-				s->bottom = del->up;
-				free(del);
-				if(s->bottom != NULL)
-				{
-						s->bottom->down = NULL;
-				}
-				free_bytes += (sizeof(struct STACK_EL) 
-					+ PACKET_HEADER_SIZE + tmp->h.len);
-				return tmp;
+				free(c);
+				pack->h.flags |= PACKET_INCOMPRESSIBLE;
+				return pack;
 		}
+		c->h = pack->h;
+		c->h.len = len;
+		c->h.flags |= PACKET_COMPRESSED;
+		free(pack);
+		return c;
 }
 
 /*
@@ -129,16 +510,27 @@ static PACKET* dequeue(STACK* s)
  */
 static void push(STACK* s, PACKET* pack) 
 {
-		int mem_used = (sizeof(struct STACK_EL) + 
-			PACKET_HEADER_SIZE + pack->h.len);
+		if(COMPRESS)
+				pack = compress_packet(pack);
 
-		while(get_public_nbytes_free() < mem_used) 
+		if(STORE && !store_owns(pack))
 		{
-				free(dequeue(s));
+				/*
+				 * from now on work on the copy in the store,
+				 * unless that is full
+				 */
+				PACKET* stored = store_put(pack);
+				if(stored != NULL)
+				{
+						free(pack);
+						pack = stored;
+				}
 		}
 
 		struct STACK_EL* e = malloc(sizeof(struct STACK_EL));
 		e->p = pack;
+		e->hop = nodeinfo.nodenumber;
+		e->sent = nodeinfo.time_in_usec;
 		e->down = s->top;
 		e->up = NULL;
 		if(is_empty(s))
@@ -150,7 +542,7 @@ static void push(STACK* s, PACKET* pack)
 				s->top->up = e;
 		}
 		s->top = e;
-		free_bytes -= mem_used;
+		charge(pack, 1);
 }
 
 
@@ -173,12 +565,464 @@ static PACKET* pop(STACK* s)
 				{
 						s->top->up = NULL;
 				}
-				free_bytes += (sizeof(struct STACK_EL) + 
-					PACKET_HEADER_SIZE + ret->h.len);
+				else
+				{
+						s->bottom = NULL;
+				}
+				charge(ret, -1);
 				return ret;
 		}
 }
 
+/*
+ * remove element e from anywhere in stack s and return its packet
+ */
+static PACKET* remove_el(STACK* s, struct STACK_EL* e)
+{
+		PACKET* ret = e->p;
+		if(s->top == e)
+		{
+				s->top = e->down;
+		}
+		if(s->bottom == e)
+		{
+				s->bottom = e->up;
+		}
+		if(e->down != NULL)
+		{
+				e->down->up = e->up;
+		}
+		if(e->up != NULL)
+		{
+				e->up->down = e->down;
+		}
+		free(e);
+		charge(ret, -1);
+		return ret;
+}
+
+/*
+ * find the element holding packet (source, seq) in stack s,
+ * NULL if there is none
+ */
+static struct STACK_EL* find_el(STACK* s, CnetAddr source, int seq)
+{
+		for(struct STACK_EL* e = s->top; e != NULL; e = e->down)
+		{
+				if(e->p->h.source == source && e->p->h.seq == seq)
+						return e;
+		}
+		return NULL;
+}
+
+/*
+ * find the packet from source in stack s to shed first: the oldest
+ * expired one, or else the oldest of the least important class no 
+ * more important than prio. NULL if there is none
+ */
+static struct STACK_EL* victim_from(STACK* s, CnetAddr source, int prio)
+{
+		struct STACK_EL* v = NULL;
+		for(struct STACK_EL* e = s->bottom; e != NULL; e = e->up)
+		{
+				if(e->p->h.source != source)
+						continue;
+				if(is_expired(e->p))
+						return e;
+				if(e->p->h.prio >= prio && (v == NULL || e->p->h.prio > v->p->h.prio))
+						v = e;
+		}
+		return v;
+}
+
+/*
+ * find the packet to shed from the public buffer for a packet of 
+ * class prio: from the least important class held, the victim of the 
+ * source holding the most bytes. NULL if there is none
+ */
+static struct STACK_EL* largest_hog(int prio)
+{
+		for(int c = PRIO_LOW; c >= prio; c--)
+		{
+				struct STACK_EL* e = NULL;
+				int most = 0;
+				for(int i = 0; i < num_sources; i++)
+				{
+						if(source_use[i].bytes <= most)
+								continue;
+						struct STACK_EL* tmp = victim_from(buff, source_use[i].addr, c);
+						if(tmp != NULL)
+						{
+								most = source_use[i].bytes;
+								e = tmp;
+						}
+				}
+				if(e != NULL)
+						return e;
+		}
+		return NULL;
+}
+
+/*
+ * returns true if pack can be buffered without shedding load
+ */
+static bool fits(PACKET* pack)
+{
+		if(is_own(pack))
+				return private_free_bytes >= MEM_USED(pack);
+		return free_bytes >= MEM_USED(pack) &&
+			*bytes_of(pack->h.source) + MEM_USED(pack) <= SOURCE_QUOTA;
+}
+
+/*
+ * Shed load from the buffer pack belongs in until pack fits. 
+ * Our own oldest packets make way for newer ones. In the public
+ * buffer a source over its quota loses its own oldest packets, 
+ * otherwise the largest hog loses its oldest. Either way expired
+ * packets go first, then the least important class, and nothing
+ * more important than pack is shed.
+ *
+ * Returns false if no room could be made, e.g. because the space
+ * is held by packets awaiting custody or more important packets.
+ */
+static bool make_room(PACKET* pack)
+{
+		if(is_own(pack))
+		{
+				while(!fits(pack))
+				{
+						struct STACK_EL* e = victim_from(own, pack->h.source, 
+							pack->h.prio);
+						if(e == NULL)
+								break;
+						drop(remove_el(own, e));
+						own_shed++;
+				}
+				return fits(pack);
+		}
+
+		int* used = bytes_of(pack->h.source);
+		while(*used + MEM_USED(pack) > SOURCE_QUOTA)
+		{
+				struct STACK_EL* e = victim_from(buff, pack->h.source, pack->h.prio);
+				if(e == NULL)
+						return false;
+				drop(remove_el(buff, e));
+		}
+		while(free_bytes < MEM_USED(pack))
+		{
+				struct STACK_EL* e = largest_hog(pack->h.prio);
+				if(e == NULL)
+						return false;
+				drop(remove_el(buff, e));
+		}
+		return true;
+}
+
+/*
+ * Buffer pack in the buffer it belongs in, shedding load if 
+ * needed. Returns false if pack had to be dropped instead.
+ */
+static bool buffer_packet(PACKET* pack)
+{
+		if(COMPRESS)
+				pack = compress_packet(pack);
+		if(!make_room(pack))
+		{
+				if(is_own(pack))
+						own_shed++;
+				drop(pack);
+				return false;
+		}
+		push(is_own(pack) ? own : buff, pack);
+		return true;
+}
+
+/*
+ ****************************
+ * SUMMARY VECTOR FUNCTIONS *
+ ****************************
+ */
+
+/*
+ * returns true if the packet (source, seq) has been accepted recently
+ */
+static bool is_seen(CnetAddr source, int seq)
+{
+		for(int i = 0; i < seen_count; i++)
+		{
+				if(seen[i].source == source && seen[i].seq == seq)
+						return true;
+		}
+		return false;
+}
+
+/*
+ * remember that packet (source, seq) has been accepted
+ */
+static void mark_seen(CnetAddr source, int seq)
+{
+		seen[seen_next].source = source;
+		seen[seen_next].seq = seq;
+		seen_next = (seen_next + 1) % SEEN_SIZE;
+		if(seen_count < SEEN_SIZE)
+				seen_count++;
+}
+
+/*
+ * Sets *h1 and *h2 to the two hashes of a packet id, from which
+ * the SUMMARY_HASHES bit positions are derived (double hashing)
+ */
+static void summary_hash(CnetAddr source, int seq, uint32_t* h1, uint32_t* h2)
+{
+		uint32_t h = (uint32_t) source * 0x9E3779B1u ^ (uint32_t) seq;
+		h ^= h >> 16;
+		h *= 0x85EBCA6Bu;
+		h ^= h >> 13;
+		*h1 = h;
+		*h2 = (h * 0xC2B2AE35u) | 1;
+}
+
+/*
+ * add a packet id to a summary vector
+ */
+static void summary_add(unsigned char* sv, CnetAddr source, int seq)
+{
+		uint32_t h1, h2;
+		summary_hash(source, seq, &h1, &h2);
+		for(int i = 0; i < SUMMARY_HASHES; i++)
+		{
+				uint32_t bit = (h1 + i * h2) % SUMMARY_BITS;
+				sv[bit / 8] |= (1 << (bit % 8));
+		}
+}
+
+/*
+ * returns true if a packet id may be in a summary vector. 
+ * False positives are possible, false negatives are not.
+ */
+static bool summary_test(unsigned char* sv, CnetAddr source, int seq)
+{
+		uint32_t h1, h2;
+		summary_hash(source, seq, &h1, &h2);
+		for(int i = 0; i < SUMMARY_HASHES; i++)
+		{
+				uint32_t bit = (h1 + i * h2) % SUMMARY_BITS;
+				if((sv[bit / 8] & (1 << (bit % 8))) == 0)
+						return false;
+		}
+		return true;
+}
+
+/*
+ * Send a summary vector of all packets we hold or have seen to nb
+ */
+static void send_summary(CnetAddr nb)
+{
+		int mem_used = PACKET_HEADER_SIZE + SUMMARY_BYTES;
+		PACKET* pack = malloc(mem_used);
+		memset(&pack->h, 0, PACKET_HEADER_SIZE);
+		pack->h.type = NET_SUMMARY;
+		pack->h.source = nodeinfo.nodenumber;
+		pack->h.dest = nb;
+		pack->h.seq = 0;
+		pack->h.len = SUMMARY_BYTES;
+		pack->h.copies = 1;
+		pack->h.flags = 0;
+		pack->h.prio = PRIO_HIGH;
+		pack->h.deadline = 0;
+		memset(pack->msg, 0, SUMMARY_BYTES);
+
+		for(int i = 0; i < seen_count; i++)
+		{
+				summary_add((unsigned char*) pack->msg, 
+					seen[i].source, seen[i].seq);
+		}
+		STACK* stacks[] = { own, buff };
+		for(int i = 0; i < 2; i++)
+		{
+				for(struct STACK_EL* e = stacks[i]->top; e != NULL; e = e->down)
+				{
+						summary_add((unsigned char*) pack->msg, 
+							e->p->h.source, e->p->h.seq);
+				}
+		}
+
+		link_send_data((char*) pack, mem_used, nb, PRIO_HIGH);
+		free(pack);
+}
+
+/*
+ * Handle a summary vector from nb: send it copies of the
+ * packets it does not have, up to EPIDEMIC_CONTACT_BYTES
+ */
+static void recv_summary(PACKET* sv, CnetAddr nb)
+{
+		if(sv->h.len != SUMMARY_BYTES)
+				return;
+
+		int budget = EPIDEMIC_CONTACT_BYTES;
+		STACK* stacks[] = { own, buff };
+		for(int i = 0; i < 2; i++)
+		{
+				for(struct STACK_EL* e = stacks[i]->top; e != NULL; e = e->down)
+				{
+						PACKET* pack = e->p;
+						int mem_used = PACKET_HEADER_SIZE + pack->h.len;
+						if(mem_used > budget)
+								return;
+						if(summary_test((unsigned char*) sv->msg, 
+							pack->h.source, pack->h.seq))
+								continue;
+						if(!is_good_carrier(nb, nb, mem_used))
+								return;
+						if(is_expired(pack))
+								continue;
+						link_send_data((char*) pack, mem_used, nb, pack->h.prio);
+						budget -= mem_used;
+				}
+		}
+}
+
+/*
+ * Avoid hop as a next hop for FAIL_HOLDOFF
+ */
+static void mark_failed(CnetAddr hop)
+{
+		failed[failed_next].hop = hop;
+		failed[failed_next].until = nodeinfo.time_in_usec + FAIL_HOLDOFF;
+		failed_next = (failed_next + 1) % FAILED_SIZE;
+}
+
+/*
+ * returns true if hop should not be used as a next hop at the moment,
+ * because it is busy or has recently failed us
+ */
+static bool is_unusable(CnetAddr hop)
+{
+		if(link_queued(hop) >= LINK_BUSY_FRAMES)
+				return true;
+		for(int i=0;i<FAILED_SIZE;i++)
+		{
+				if(failed[i].hop == hop && failed[i].until > nodeinfo.time_in_usec)
+						return true;
+		}
+		return false;
+}
+
+/*
+ ******************************
+ * CUSTODY TRANSFER FUNCTIONS *
+ ******************************
+ */
+
+/*
+ * Tell the previous hop whether we take custody of packet pack
+ */
+static void send_custody(PACKET* pack, NETTYPE decision, CnetAddr hop)
+{
+		PACKET reply;
+		memset(&reply, 0, sizeof(reply));
+		reply.h.type = decision;
+		reply.h.source = pack->h.source;
+		reply.h.dest = hop;
+		reply.h.seq = pack->h.seq;
+		reply.h.len = 0;
+		reply.h.copies = 1;
+		reply.h.flags = 0;
+		reply.h.prio = PRIO_HIGH;
+		reply.h.deadline = 0;
+		link_send_data((char*) &reply, PACKET_HEADER_SIZE, hop, PRIO_HIGH);
+}
+
+/*
+ * Decide whether to take custody of a packet arriving from hop.
+ * We accept if it is for us, if we already hold or delivered it (the
+ * previous decision was lost, so it is acknowledged and dropped), or 
+ * if we can buffer it without shedding load.
+ *
+ * Returns true if the packet should be processed.
+ */
+static bool take_custody(PACKET* pack, CnetAddr hop)
+{
+		bool dup;
+		if(pack->h.dest == nodeinfo.nodenumber)
+		{
+				dup = is_seen(pack->h.source, pack->h.seq);
+				mark_seen(pack->h.source, pack->h.seq);
+		}
+		else
+		{
+				dup = find_el(buff, pack->h.source, pack->h.seq) != NULL ||
+					find_el(pending, pack->h.source, pack->h.seq) != NULL;
+		}
+		if(dup)
+		{
+				send_custody(pack, NET_CUSTODY_ACK, hop);
+				return false;
+		}
+		if(pack->h.dest != nodeinfo.nodenumber && !fits(pack))
+		{
+				custody.refused++;
+				if(free_bytes < MEM_USED(pack))
+						custody.refused_full++;
+				else
+						custody.refused_quota++;
+				send_custody(pack, NET_CUSTODY_REFUSE, hop);
+				return false;
+		}
+		custody.accepted++;
+		send_custody(pack, NET_CUSTODY_ACK, hop);
+		return true;
+}
+
+/*
+ * Handle a custody decision from hop about one of our pending packets.
+ * Accepted packets are freed, refused ones go back to the buffer.
+ */
+static void recv_custody(PACKET* decision, CnetAddr hop)
+{
+		struct STACK_EL* e = find_el(pending, 
+			decision->h.source, decision->h.seq);
+		if(e == NULL || e->hop != hop)
+				return;
+
+		PACKET* pack = remove_el(pending, e);
+		if(decision->h.type == NET_CUSTODY_ACK)
+		{
+				custody.granted++;
+				release(pack);
+		}
+		else
+		{
+				custody.denied++;
+				mark_failed(hop);
+				push(is_own(pack) ? own : buff, pack);
+		}
+}
+
+/*
+ * Move packets which have waited too long for a custody 
+ * decision back to the buffer
+ */
+static void expire_custody()
+{
+		CnetTime t = nodeinfo.time_in_usec;
+		struct STACK_EL* e = pending->bottom;
+		while(e != NULL)
+		{
+				struct STACK_EL* next = e->up;
+				if(t > e->sent + CUSTODY_TIMEOUT)
+				{
+						custody.expired++;
+						mark_failed(e->hop);
+						PACKET* pack = remove_el(pending, e);
+						push(is_own(pack) ? own : buff, pack);
+				}
+				e = next;
+		}
+}
+
 /*
  ********************************
  * NETWORK MANAGEMENT FUNCTIONS *
@@ -190,13 +1034,51 @@ static PACKET* pop(STACK* s)
  * to forward the message. If such a link does exist, send
  * it to the data link layer and free the memory 
  * (free(pack)). If no such link exists
- * then buffer pack
+ * then buffer pack in the buffer it belongs in
  */
-static void try_to_send(PACKET* pack, STACK* s) 
+static void try_to_send(PACKET* pack) 
 {
+		if(is_expired(pack))
+		{
+				drop(pack);
+				return;
+		}
 		int mem_used = PACKET_HEADER_SIZE + pack->h.len;
 		CnetAddr add_p;
-		bool can_send = get_nth_best_node(&add_p, 0, pack->h.dest, mem_used);
+		bool can_send;
+		if(ROUTING == ROUTE_SPRAY_WAIT || ROUTING == ROUTE_EPIDEMIC)
+		{
+				/*
+				 * copies are only handed out on contact, see
+				 * net_neighbour_up. Here we only deliver directly.
+				 */
+				add_p = pack->h.dest;
+				can_send = is_good_carrier(add_p, pack->h.dest, mem_used);
+		}
+		else
+		{
+				/*
+				 * take the best candidate which is not busy 
+				 * and has not failed us recently
+				 */
+				can_send = false;
+				for(int n=0;n<NET_CANDIDATES && !can_send;n++)
+				{
+						if(!get_nth_best_node(&add_p, n, pack->h.dest, mem_used))
+								break;
+						can_send = !is_unusable(add_p);
+				}
+		}
+
+		/*
+		 * with CUSTODY a copy is kept until add_p takes custody. It 
+		 * must fit without shedding other packets, some of which we
+		 * may hold custody of, or the packet waits in the buffer.
+		 * A packet we took custody of always fits, as take_custody 
+		 * only accepts those
+		 */
+		if(can_send && CUSTODY && !fits(pack))
+				can_send = false;
 
 		if (can_send) 
 		{
@@ -205,8 +1087,22 @@ static void try_to_send(PACKET* pack, STACK* s)
 				 */
 				if(mem_used <= MAX_PACKET_SIZE) 
 				{
-						link_send_data((char*) pack, mem_used, add_p);
-						free(pack);
+						link_send_data((char*) pack, mem_used, add_p, pack->h.prio);
+						if(is_own(pack))
+								drained += MEM_USED(pack);
+						if(CUSTODY)
+						{
+								/*
+								 * keep it until add_p takes custody
+								 */
+								push(pending, pack);
+								pending->top->hop = add_p;
+								pending->top->sent = nodeinfo.time_in_usec;
+						}
+						else
+						{
+								release(pack);
+						}
 				}
 		}
 		else 
@@ -214,7 +1110,23 @@ static void try_to_send(PACKET* pack, STACK* s)
 				/* 
 				 * buffer it.
 				 */
-				push(s, pack);
+				buffer_packet(pack);
+		}
+}
+
+/*
+ * move the packets of class prio in stack s onto the retry stack,
+ * newest first, so that the oldest of them ends up on top
+ */
+static void move_class(STACK* s, int prio)
+{
+		struct STACK_EL* e = s->top;
+		while(e != NULL)
+		{
+				struct STACK_EL* next = e->down;
+				if(e->p->h.prio == prio)
+						push(retry, remove_el(s, e));
+				e = next;
 		}
 }
 
@@ -224,54 +1136,128 @@ static void try_to_send(PACKET* pack, STACK* s)
 void net_send_buffered() 
 {
 		/*
-		 * Attempt to send buffered messages. Use a temporary stack to 
-		 * store packets that are popped but can't be sent. Then, when
-		 * when we're done, simply push the whole temporary stack back
-		 * onto the buffer. Free the memory for any packets that are sent.
+		 * Attempt to send buffered messages. Move both buffers onto a 
+		 * temporary stack class by class, the least important first,
+		 * which leaves the oldest packet of the most important class on
+		 * top, then try to send each packet in turn. Packets that can't
+		 * be sent are buffered again in their original order. 
 		 */
-		STACK* temp_stack = new_stack();
+		if(CUSTODY)
+				expire_custody();
 
-		PACKET* tmp = pop(buff);
-		while(tmp != NULL) 
+		for(int c = PRIO_LOW; c >= PRIO_HIGH; c--)
 		{
-				try_to_send(tmp, temp_stack);
-				tmp = pop(buff);
+				move_class(buff, c);
+				move_class(own, c);
 		}
 
-		tmp = pop(temp_stack);
+		PACKET* tmp = pop(retry);
 		while(tmp != NULL) 
 		{
-				push(buff, tmp);
-				tmp = pop(temp_stack);
+				try_to_send(tmp);
+				tmp = pop(retry);
+		}
+}
+
+/*
+ * Called by oracle when a beacon is heard from a node which was not
+ * live, i.e. at the start of a contact with nb.
+ *
+ * Epidemic: send nb our summary vector.
+ *
+ * Binary spray and wait: every buffered packet for which we still hold
+ * more than one copy token, and for which nb is a good carrier, is 
+ * copied to nb along with half of our tokens. 
+ */
+void net_neighbour_up(CnetAddr nb)
+{
+		if(ROUTING == ROUTE_EPIDEMIC)
+		{
+				send_summary(nb);
+				return;
 		}
+		if(ROUTING != ROUTE_SPRAY_WAIT)
+				return;
 
-		free(temp_stack);
+		STACK* stacks[] = { own, buff };
+		for(int i = 0; i < 2; i++)
+		{
+				for(struct STACK_EL* e = stacks[i]->top; e != NULL; e = e->down)
+				{
+						PACKET* pack = e->p;
+						int mem_used = PACKET_HEADER_SIZE + pack->h.len;
+						if(pack->h.copies < 2 || pack->h.dest == nb || is_expired(pack))
+								continue;
+						if(!is_good_carrier(nb, pack->h.dest, mem_used))
+								continue;
+
+						/*
+						 * the frame is copied by the link layer, so we can 
+						 * send straight from our own buffered packet
+						 */
+						int copies = pack->h.copies;
+						pack->h.copies = copies / 2;
+						link_send_data((char*) pack, mem_used, nb, pack->h.prio);
+						pack->h.copies = copies - copies / 2;
+				}
+		}
 }
 
 /*
- * Send data msg length len to destination dst.
+ * Send data msg length len, class prio and deadline to destination dst.
  * This function is called from the transport layer
  * return false on some error
  */
-bool net_send(char* msg, int len, CnetAddr dst) 
+bool net_send(char* msg, int len, CnetAddr dst, int prio, CnetTime deadline) 
+{
+		NETVEC vec = { msg, len };
+		return net_sendv(&vec, 1, dst, prio, deadline);
+}
+
+/*
+ * Send the message made up of count pieces in vec to dst, copying
+ * each piece straight into the packet
+ */
+bool net_sendv(NETVEC* vec, int count, CnetAddr dst, int prio, 
+	CnetTime deadline) 
 {
 		/*
 		 * call get_nth_best_node and try send the data there,
 		 * or buffer it if there is no good node.
 		 */
+		int len = 0;
+		for(int i = 0; i < count; i++)
+		{
+				len += vec[i].len;
+		}
 		int mem_used = PACKET_HEADER_SIZE + len;
 		PACKET* pack = malloc(mem_used);
+		memset(&pack->h, 0, PACKET_HEADER_SIZE);
+		pack->h.type = NET_DATA;
 		pack->h.source = nodeinfo.nodenumber;
 		pack->h.dest = dst;
+		pack->h.seq = ++seq_counter;
 		pack->h.len = len;
-		memcpy(pack->msg, msg, len);
+		pack->h.copies = (ROUTING == ROUTE_SPRAY_WAIT) ? SPRAY_COPIES : 1;
+		pack->h.flags = 0;
+		pack->h.prio = prio;
+		pack->h.deadline = deadline;
+		char* p = pack->msg;
+		for(int i = 0; i < count; i++)
+		{
+				memcpy(p, vec[i].base, vec[i].len);
+				p += vec[i].len;
+		}
+		if(ROUTING == ROUTE_EPIDEMIC)
+				mark_seen(pack->h.source, pack->h.seq);
 		/*
 		 * attempt to send message. if it can not be sent, buffer
-		 * it on buff 
+		 * it on own
 		 */
-		try_to_send(pack, buff);
+		int shed = own_shed;
+		try_to_send(pack);
 
-		return true;
+		return own_shed == shed;
 }
 
 /*
@@ -298,6 +1284,51 @@ void net_recv(char* msg, int len, CnetAddr src)
 		int mem_used = len;
 		PACKET* pack = malloc(mem_used);
 		memcpy(pack, msg, mem_used);
+
+		if(pack->h.type == NET_SUMMARY)
+		{
+				recv_summary(pack, src);
+				free(pack);
+				return;
+		}
+		if(pack->h.type == NET_CUSTODY_ACK || 
+			pack->h.type == NET_CUSTODY_REFUSE)
+		{
+				recv_custody(pack, src);
+				free(pack);
+				return;
+		}
+		/*
+		 * a class we don't know is the least important
+		 */
+		if(pack->h.prio < PRIO_HIGH || pack->h.prio > PRIO_LOW)
+				pack->h.prio = PRIO_LOW;
+		if(CUSTODY && !take_custody(pack, src))
+		{
+				free(pack);
+				return;
+		}
+		/*
+		 * with CUSTODY, take_custody has already dropped the copies
+		 * for us we have seen
+		 */
+		bool for_us = pack->h.dest == nodeinfo.nodenumber;
+		if((ROUTING == ROUTE_EPIDEMIC || (ROUTING == ROUTE_SPRAY_WAIT && for_us))
+			&& !(CUSTODY && for_us))
+		{
+				/*
+				 * drop copies we already hold or have delivered. With
+				 * spray and wait several copies of a packet can reach
+				 * its destination too
+				 */
+				if(is_seen(pack->h.source, pack->h.seq))
+				{
+						free(pack);
+						return;
+				}
+				mark_seen(pack->h.source, pack->h.seq);
+		}
+
 		/*
 		 * if the destination is this node
 		 */
@@ -307,7 +1338,18 @@ void net_recv(char* msg, int len, CnetAddr src)
 				 * pass it right on up to the transport layer.
 				 * free the memory (free(pack)).
 				 */
-				transport_recv(pack->msg, pack->h.len, pack->h.source);
+				if(pack->h.flags & PACKET_COMPRESSED)
+				{
+						char msg[MAX_DATAGRAM_SIZE];
+						int len = lz_decompress((unsigned char*) pack->msg,
+							pack->h.len, (unsigned char*) msg, MAX_DATAGRAM_SIZE);
+						if(len >= 0)
+								transport_recv(msg, len, pack->h.source);
+				}
+				else
+				{
+						transport_recv(pack->msg, pack->h.len, pack->h.source);
+				}
 				free(pack);
 		}
 		else 
@@ -316,12 +1358,62 @@ void net_recv(char* msg, int len, CnetAddr src)
 				 * attempt to send message. if it can not be sent, buffer
 				 * it on buff
 				 */
-				try_to_send(pack, buff);
+				try_to_send(pack);
 		}
 }
 
 
 
+/*
+ * Print statistics for this node, called at shutdown
+ */
+void net_report()
+{
+		for(int c = PRIO_HIGH; c <= PRIO_LOW; c++)
+		{
+				printf("node %d class %d packets: shed %d, expired %d\n",
+					nodeinfo.nodenumber, c, dropped[c].shed, dropped[c].expired);
+		}
+		if(CUSTODY)
+		{
+				printf("node %d custody: accepted %d refused %d "
+					"(buffer full %d, over quota %d), next hop accepted %d "
+					"refused %d timed out %d\n", nodeinfo.nodenumber, 
+					custody.accepted, custody.refused, custody.refused_full,
+					custody.refused_quota, custody.granted, custody.denied, 
+					custody.expired);
+		}
+}
+
+/*
+ * Called by the store when compaction moves a packet
+ */
+static void relocate(PACKET* from, PACKET* to)
+{
+		STACK* stacks[] = { own, buff, pending, retry };
+		for(int i = 0; i < 4; i++)
+		{
+				for(struct STACK_EL* e = stacks[i]->top; e != NULL; e = e->down)
+				{
+						if(e->p == from)
+						{
+								e->p = to;
+								return;
+						}
+				}
+		}
+}
+
+/*
+ * Called by the store for each packet it held before a reboot
+ */
+static void readmit(PACKET* pack)
+{
+		if(is_own(pack) && pack->h.seq > seq_counter)
+				seq_counter = pack->h.seq;
+		push(is_own(pack) ? own : buff, pack);
+}
+
 /*
  * called at program start
  */
@@ -329,4 +1421,28 @@ void net_init()
 {
 		free_bytes = NETWORK_BUFF_SIZE;
 		buff = 	new_stack();
+		private_free_bytes = PRIVATE_BUFF_SIZE;
+		own = new_stack();
+		source_use = NULL;
+		num_sources = 0;
+		dest_use = NULL;
+		num_dests = 0;
+		pending = new_stack();
+		retry = new_stack();
+		memset(&custody, 0, sizeof(custody));
+		seq_counter = nodeinfo.time_in_usec / SEQ_TICK;
+		seen_next = 0;
+		seen_count = 0;
+		own_shed = 0;
+		memset(dropped, 0, sizeof(dropped));
+		drained = 0;
+		drain_rate = 0;
+		drain_sampled = nodeinfo.time_in_usec;
+
+		/*
+		 * at time 0 the simulation is starting, later we are rebooting.
+		 * The store may hold own packets numbered past the time
+		 */
+		if(STORE)
+				store_init(nodeinfo.time_in_usec > 0, readmit, relocate);
 }
@@ -10,15 +10,153 @@
  *
  * Routing is non-flooding, packets are forwarded only once.
  *
- * Packets are routed to any node which is closer than itself to the
+ * Packets are routed to a node which is closer than itself to the
  * last known position of the destination node. If no position
  * is known for the destination node, the packet is not forwarded.
  * The exception being, if a neighbour node's buffers are full,
  * then the packet will not be forwarded to that neighbour.
  *
+ * The candidates are ranked: the destination itself comes first, the
+ * rest by their progress towards the destination, weighted by the
+ * quality of our link to them (the share of their beacons we hear) and
+ * by their free buffer space. The network layer can fall back to the 
+ * next candidate if the best one is busy.
+ *
+ * With ROUTING == ROUTE_BACKPRESSURE the beacons also carry the bytes
+ * the sender has buffered for each destination. Candidates which make
+ * progress are then ranked by how much shorter their queue for the
+ * destination is than ours, and only used if it is shorter at all. 
+ * The buffer weight uses the free space a neighbour is expected to 
+ * have left when it goes quiet at the rate it has been filling up, so
+ * relays which are filling fast are avoided before they overflow.
+ *
+ * The first beacon heard from a node which was not live is reported to
+ * the network layer as a new contact, which the multi-copy routing
+ * engines use to decide when to hand out copies.
+ *
+ * Routing aims at where a destination is expected to be now rather
+ * than where it was last seen. Each record keeps the last HISTORY 
+ * positions of its node, and the node's velocity is estimated from
+ * those of the last HISTORY_SPAN seconds. The last position is moved 
+ * along it for as long as the information is old, but no further
+ * ahead than the history reaches back. The age is taken on the node's
+ * own clock when we have heard from it directly, otherwise from when
+ * we got the position. The node may have strayed from the predicted
+ * position by UNCERTAINTY_RATE metres for every second of that age, 
+ * up to UNCERTAINTY_MAX, and a hop only counts as progress while we
+ * are outside that radius: inside it, we wait to meet the destination.
+ *
+ * The next hops towards each destination are cached in its record (the
+ * FIB), so routing a packet is a single lookup. When a neighbour 
+ * comes into range, moves, goes or changes its link quality or buffer
+ * space, only the caches of the destinations it is a next hop for, or
+ * could be one for where it is now, are dropped. The cache of a single
+ * destination is dropped when its position changes, and every cache
+ * once we have moved FIB_MOVE metres. As that is more than MINDIST, a 
+ * cached hop is only used if it still makes progress from where we 
+ * really are, so it never takes a packet backwards.
+ *
+ * With ROUTING == ROUTE_PROPHET nodes also keep a delivery predictability
+ * for every known node, which is raised on each beacon from it, aged 
+ * over time and updated transitively from the predictabilities carried
+ * in neighbours' beacons. Packets are then forwarded to the neighbour
+ * most likely to meet the destination, so no position is needed.
+ *
+ * Beacons are incremental. Every record carries the version of our DB
+ * at which what we advertise about it last changed, and a beacon only
+ * holds the records which changed or were dropped since the last one,
+ * along with the version the delta applies to and a digest of the
+ * versions of all our records. A dropped record goes out as version 0.
+ * Every BEACON_FULL_EVERY beacons, and whenever a neighbour asks for
+ * it, the beacon is a full snapshot instead. A receiver which finds it
+ * missed a beacon, or whose copy of the sender's view doesn't match 
+ * the digest, asks for a full beacon in its own next beacon, from all
+ * its neighbours at once if it wants one from more than one of them.
+ *
+ * The beacon interval adapts to how fast our surroundings change. It is
+ * the time we take to move BEACON_MOVE metres at our current speed,
+ * shortened by the neighbours which came or went since the last beacon
+ * and lengthened by the neighbours we can hear, which all beacon too,
+ * between BEACON_MIN_INTERVAL and BEACON_MAX_INTERVAL. Every beacon 
+ * carries the time until the next one, and a neighbour stays live for
+ * ORACLEWAIT/ORACLEINTERVAL of its own intervals after a beacon.
+ *
+ * The records live in a table of DB_SIZE fixed slots, allocated once,
+ * so a record stays where it is for as long as it is kept. They are
+ * found by address through an open addressing hash table, and listed
+ * densely in members for the loops over all records. A beacon is 
+ * merged in one go: the records it doesn't fit are made room for by
+ * dropping the records heard from least recently, all in one pass.
+ *
  */
 #include "dtn.h"
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
+
+/*
+ * PRoPHET parameters: predictability on encounter, transitive 
+ * scaling, and aging per PROPHET_AGE_UNIT
+ */
+#define PROPHET_P_INIT 0.75
+#define PROPHET_BETA 0.25
+#define PROPHET_GAMMA 0.98
+#define PROPHET_AGE_UNIT ORACLEINTERVAL
+
+/* most next hops cached per destination */
+#define FIB_WAYS 8
+
+/* metres we move before the cached next hops are found again */
+#define FIB_MOVE 5
+
+/*
+ * link quality: initial value on contact, weight of each new
+ * beacon, and the change which invalidates cached next hops
+ */
+#define LQ_INITIAL 0.5
+#define LQ_ALPHA 0.25
+#define LQ_STEP 0.05
+
+/* free buffer space at which a neighbour gets half weight */
+#define BUFFER_KNEE 65536
+
+/* weight of each new beacon in a neighbour's fill rate */
+#define FILL_ALPHA 0.25
+
+/* a free slot in the address hash table */
+#define NO_SLOT -1
+
+/* positions kept per node, and the seconds of them used for its velocity */
+#define HISTORY 4
+#define HISTORY_SPAN 10
+
+/*
+ * metres per second of age a node may have strayed from its 
+ * predicted position, and the most it is assumed to have strayed
+ */
+#define UNCERTAINTY_RATE 1.0
+#define UNCERTAINTY_MAX 50.0
+
+/* one beacon in BEACON_FULL_EVERY is a full snapshot */
+#define BEACON_FULL_EVERY 10
+
+/* the beacon holds all of the sender's records, not just the changes */
+#define BEACON_FULL 1
+/* the sender asks the node in refresh for a full beacon */
+#define BEACON_REFRESH 2
+
+/* a refresh asking every neighbour for a full beacon */
+#define REFRESH_ALL 0xFFFFFFFFu
+
+/* bounds of the beacon interval, in microseconds */
+#define BEACON_MIN_INTERVAL (ORACLEINTERVAL/3)
+#define BEACON_MAX_INTERVAL (ORACLEINTERVAL*4)
+
+/* metres we may move between beacons */
+#define BEACON_MOVE 10
+
+/* live neighbours which double the beacon interval */
+#define BEACON_CROWD 10
 
 /* 
  * structure to represent node and location 
@@ -34,11 +172,30 @@ typedef struct
 	 * timestamps from the very same sender 
 	 */
 	uint32_t timestamp;
+	/*
+	 * version of the sender's DB at which this entry last changed
+	 */
+	uint32_t version;
+	/*
+	 * the routing metric for addr of the node holding this
+	 * record. Only the routings which use one carry it, every
+	 * record it adds costs beacon room in the others
+	 */
+#if ROUTING == ROUTE_PROPHET
+	/* delivery predictability */
+	float pred;
+#elif ROUTING == ROUTE_BACKPRESSURE
+	/* bytes buffered */
+	uint32_t backlog;
+#endif
 } NODELOCATION;
 
-#define ORACLE_HEADER_SIZE (sizeof(NODELOCATION) + sizeof(uint32_t)*3)
+#define ORACLE_HEADER_SIZE (sizeof(NODELOCATION) + sizeof(uint32_t)*9)
 #define MAX_ORACLE_PAYLOAD (MAX_PACKET_SIZE - ORACLE_HEADER_SIZE)
 
+/* most records kept, as many as fit in a beacon */
+#define DB_SIZE ((int)(MAX_ORACLE_PAYLOAD / sizeof(NODELOCATION)))
+
 /* 
  * the packet structure for oracle information transmission 
  */
@@ -57,133 +214,550 @@ typedef struct
 	 * how many elements in locations 
 	 */
 	uint32_t locationsSize; 
+	/*
+	 * BEACON_* flags
+	 */
+	uint32_t flags;
+	/*
+	 * version of the sender's DB as of this beacon, and as of its 
+	 * last beacon, which a delta applies to
+	 */
+	uint32_t version;
+	uint32_t base;
+	/*
+	 * sum of the hashes of the addresses and versions of all the
+	 * sender's entries
+	 */
+	uint32_t digest;
+	/*
+	 * node asked for a full beacon (BEACON_REFRESH)
+	 */
+	uint32_t refresh;
+	/*
+	 * microseconds until the sender's next beacon
+	 */
+	uint32_t interval;
 	/*
 	 * Array of (last known) locations of known hosts 
 	 */
 	NODELOCATION locations[MAX_ORACLE_PAYLOAD]; 
 } OraclePacket;
 
+/*
+ * what a neighbour told us about a node in its last beacon
+ */
+typedef struct
+{
+	CnetAddr addr;
+	float pred;
+	uint32_t backlog;
+	uint32_t version;
+} VIEWENTRY;
+
 /* 
  * structure to store information about neighbours 
  */
 typedef struct 
 {
 	NODELOCATION nl;
+	/*
+	 * our delivery predictability for this node (PRoPHET)
+	 */
+	float pred;
 	uint32_t freeBufferSpace;
 	/* 
 	 * when did we last see a bacon from this noodle
 	 */
 	uint64_t lastBeacon;
+	/*
+	 * the beacon interval it advertised in that beacon
+	 */
+	CnetTime interval;
+	/*
+	 * share of this neighbour's beacons we hear, averaged
+	 */
+	float quality;
+	/*
+	 * bytes per second its free buffer space has been 
+	 * shrinking, averaged
+	 */
+	float fillRate;
+	/*
+	 * the neighbour's view of all other nodes, sorted by 
+	 * address, as of its last beacon. The version of its DB
+	 * then, and the digest of the view
+	 */
+	VIEWENTRY * view;
+	int viewSize;
+	int viewCapacity;
+	uint32_t viewVersion;
+	uint32_t viewDigest;
+	/*
+	 * whether our copy of its view is out of step, so we want
+	 * a full beacon from it
+	 */
+	bool refreshWanted;
+	/*
+	 * what we last advertised about this node, with the
+	 * version it got then, 0 if it hasn't been yet
+	 */
+	NODELOCATION sent;
+	/*
+	 * cached next hops towards this node, in order of preference,
+	 * with their free buffer space. Valid while fibEpoch == epoch
+	 * and until fibExpires, when the first of them goes quiet. 
+	 * Where the node was expected when they were found, and within
+	 * what radius
+	 */
+	CnetAddr fib[FIB_WAYS];
+	uint32_t fibSpace[FIB_WAYS];
+	int fibSize;
+	uint32_t fibEpoch;
+	uint64_t fibExpires;
+	CnetPosition fibDest;
+	double fibRadius;
+	/*
+	 * the last HISTORY positions of this node and their timestamps,
+	 * newest first, and how many there are
+	 */
+	CnetPosition history[HISTORY];
+	uint32_t historyTime[HISTORY];
+	int historySize;
+	/*
+	 * when we got the newest of them, and the offset of the node's
+	 * clock from ours, if we have had a beacon from it
+	 */
+	CnetTime heard;
+	CnetTime clockOffset;
+	bool offsetKnown;
+	/*
+	 * index of this record in members
+	 */
+	int member;
 } Neighbour;
 
 /*
- * last known addresses for all known nodes
+ * last known addresses for all known nodes, in DB_SIZE fixed slots
  */
 static Neighbour * positionDB;
+
+/*
+ * the slots in use, densely, and how many there are
+ */
+static int * members;
 static int dbsize;
 
-static int compareNL(const void * key, const void * elem) 
+/*
+ * the slots not in use, as a stack
+ */
+static int * freeSlots;
+static int numFree;
+
+/*
+ * hash table from address to slot, NO_SLOT where free. It has 
+ * hashSize slots, a power of two at least twice DB_SIZE
+ */
+static int * addrMap;
+static int hashSize;
+
+/*
+ * the record in position i of members
+ */
+#define MEMBER(i) (&positionDB[members[(i)]])
+
+/*
+ * version of our DB, bumped for every entry that changes, and as of
+ * our last beacon. The digest of the versions of all our entries
+ */
+static uint32_t dbVersion;
+static uint32_t lastBeaconVersion;
+static uint32_t dbDigest;
+
+/*
+ * beacons since the last full one, and whether a neighbour has 
+ * asked for a full one
+ */
+static int sinceFull;
+static bool fullWanted;
+
+/*
+ * advertised records dropped since our last beacon
+ */
+static CnetAddr * dropped;
+static int numDropped;
+
+/*
+ * our beacon interval, where and when we sent our last beacon, the
+ * neighbours live then, and the new contacts since
+ */
+static CnetTime interval;
+static CnetPosition lastBeaconPos;
+static CnetTime lastBeaconTime;
+static int lastLive;
+static int contacts;
+
+/*
+ * beacon statistics for this node
+ */
+static struct
 {
-	uint32_t k = *((uint32_t *)key);
-	uint32_t addr = (uint32_t)(((Neighbour *)(elem))->nl.addr);
-	return k-addr ;
+	/* full and delta beacons sent */
+	int full;
+	int delta;
+	/* entries and bytes in them */
+	int entries;
+	int bytes;
+	/* full beacons asked for */
+	int refreshes;
+	/* sum of the intervals between them */
+	CnetTime intervals;
+} beacons;
+
+/*
+ * time up to which predictabilities have been aged
+ */
+static CnetTime lastAged;
+
+/*
+ * bumped whenever all cached next hops become invalid, as we have
+ * moved more than FIB_MOVE, and our position then. The next hops are
+ * found from there
+ */
+static uint32_t epoch;
+static CnetPosition fibPos;
+
+/*
+ * how long a neighbour stays live after a beacon, scaled to the 
+ * interval it advertised
+ */
+static CnetTime liveWait(Neighbour * nbp)
+{
+	return nbp->interval * (ORACLEWAIT / ORACLEINTERVAL);
 }
 
 /*
- * Add a position to the positionDB
- * maintaining db sortedness or update 
- * the existing position if the address
- * already exists
+ * returns true if we have had a beacon from this neighbour recently
  */
-static void savePosition(NODELOCATION n) 
+static bool isLive(Neighbour * nbp, CnetTime t)
 {
-	CnetAddr * np = &(n.addr);
-	Neighbour * nbp  = bsearch(np, positionDB, 
-		dbsize, sizeof(Neighbour), compareNL);
-	if(nbp == NULL) 
-	{
-		/*
-		 * append and sort
-		 */
-		dbsize++;
-		positionDB = realloc(positionDB, sizeof(Neighbour)*dbsize);
-		positionDB[dbsize-1].nl = n;
-		positionDB[dbsize-1].lastBeacon = 0; 
-		qsort(positionDB, dbsize, sizeof(Neighbour), compareNL);
-	} 
+	return nbp->lastBeacon != 0 && t <= nbp->lastBeacon + liveWait(nbp);
+}
+
+/*
+ * the home of addr in the address hash table
+ */
+static int hashOf(CnetAddr addr)
+{
+	return (int)(((uint32_t)addr * 0x9E3779B1u) >> 16) & (hashSize - 1);
+}
+
+/*
+ * returns the position of addr in the address hash table, or the
+ * free position where it belongs
+ */
+static int findHash(CnetAddr addr)
+{
+	int h = hashOf(addr);
+	while(addrMap[h] != NO_SLOT && positionDB[addrMap[h]].nl.addr != addr)
+		h = (h + 1) & (hashSize - 1);
+	return h;
+}
+
+/*
+ * the hash of an entry of a given version, summed up in digests
+ */
+static uint32_t entryHash(CnetAddr addr, uint32_t version)
+{
+	uint32_t h = ((uint32_t)addr * 0x9E3779B1u) ^ (version * 0x85EBCA6Bu);
+	h ^= h >> 15;
+	h *= 0xC2B2AE35u;
+	h ^= h >> 13;
+	return h;
+}
+
+/*
+ * returns the record of addr, NULL if there is none
+ */
+static Neighbour * lookup(CnetAddr addr)
+{
+	int slot = addrMap[findHash(addr)];
+	return slot == NO_SLOT ? NULL : &positionDB[slot];
+}
+
+/* 
+ * returns true iff: 
+ * 	a->c > b->c
+ * 	by some interval defined in dtn.h
+ */
+bool isCloser(CnetPosition a, CnetPosition b, CnetPosition c, int interval) 
+{
+	int cax = c.x - a.x;
+	int cay = c.y - a.y;
+	int cbx = c.x - b.x;
+	int cby = c.y - b.y;
+	if( cbx*cbx + cby*cby + interval*interval < cax*cax + cay*cay )
+		return true;
 	else 
+		return false;
+}
+
+/*
+ * distance in metres between two positions
+ */
+static double distance(CnetPosition a, CnetPosition b)
+{
+	double dx = a.x - b.x;
+	double dy = a.y - b.y;
+	return sqrt(dx*dx + dy*dy);
+}
+
+/*
+ * returns true if going from a to b makes progress towards a node 
+ * expected at c, as isCloser() has it, and a is more than MINDIST 
+ * outside the radius the node may be in
+ */
+static bool makesProgress(CnetPosition a, CnetPosition b, CnetPosition c, 
+	double radius)
+{
+	return distance(a, c) > radius + MINDIST && isCloser(a, b, c, MINDIST);
+}
+
+/*
+ * drop the cached next hops which a change in the live neighbour nbp
+ * may have made wrong: those towards nbp, those through it, and those
+ * for which it is, where it is now, a candidate
+ */
+static void dropFibsBy(Neighbour * nbp)
+{
+	for(int i=0;i<dbsize;i++)
+	{
+		Neighbour * dp = MEMBER(i);
+		if(dp->fibEpoch != epoch) continue;
+		bool stale = dp == nbp || 
+			makesProgress(fibPos, nbp->nl.loc, dp->fibDest, dp->fibRadius);
+		for(int j=0;j<dp->fibSize && !stale;j++)
+			stale = dp->fib[j] == nbp->nl.addr;
+		if(stale) dp->fibEpoch = 0;
+	}
+}
+
+/*
+ * remove the record nbp from the DB. The records after it in its
+ * run of the hash table are moved back, so lookups need no tombstones
+ */
+static void dbRemove(Neighbour * nbp) 
+{
+	int h = findHash(nbp->nl.addr);
+	addrMap[h] = NO_SLOT;
+	for(int j = (h + 1) & (hashSize - 1); addrMap[j] != NO_SLOT; 
+		j = (j + 1) & (hashSize - 1))
 	{
 		/*
-		 * update location for this node if it's a newer reading
+		 * move addrMap[j] into the hole at h unless its home
+		 * lies cyclically in (h, j]
 		 */
-		if(nbp->nl.timestamp < n.timestamp) 
-		{
-			nbp->nl.loc = n.loc;
-			nbp->nl.timestamp = n.timestamp;
-		}
+		int home = hashOf(positionDB[addrMap[j]].nl.addr);
+		if(((j - home) & (hashSize - 1)) < ((j - h) & (hashSize - 1)))
+			continue;
+		addrMap[h] = addrMap[j];
+		addrMap[j] = NO_SLOT;
+		h = j;
 	}
+
+	/*
+	 * the last member takes its place in members
+	 */
+	if(nbp->sent.version != 0)
+	{
+		dbDigest -= entryHash(nbp->nl.addr, nbp->sent.version);
+		if(numDropped < DB_SIZE)
+			dropped[numDropped++] = nbp->nl.addr;
+		else
+			fullWanted = true;
+	}
+	int last = members[--dbsize];
+	members[nbp->member] = last;
+	positionDB[last].member = nbp->member;
+	freeSlots[numFree++] = nbp - positionDB;
+	dropFibsBy(nbp);
 }
 
-/* 
- * checksum an oracle packet, return the result crc32
+/*
+ * compare function for qsort, the record heard from least
+ * recently first
  */
-static uint32_t checksum_oracle_packet(OraclePacket * p) 
+static int compareHeard(const void * a, const void * b)
 {
-	p->checksum = 0;
-	return CNET_crc32((unsigned char*)p, sizeof(OraclePacket) 
-		- sizeof(p->locations) + sizeof(NODELOCATION)*p->locationsSize);
+	uint64_t x = positionDB[*(int *)a].lastBeacon;
+	uint64_t y = positionDB[*(int *)b].lastBeacon;
+	return x < y ? -1 : x > y;
 }
 
 /* 
- * remove a specific item from the DB
+ * drop the n records heard from least recently, all at once, but
+ * never keep. Only needed when the DB is full
  */
-static void dbRemove(int index) 
+static void pruneDB(int n, Neighbour * keep) 
 {
-	if(index != dbsize-1) 
+	int size = dbsize;
+	int * byAge = malloc(sizeof(int)*size);
+	memcpy(byAge, members, sizeof(int)*size);
+	qsort(byAge, size, sizeof(int), compareHeard);
+	for(int i=0;i<size && n>0;i++) 
 	{
-		for(int i=index+1;i<dbsize;i++) 
-		{
-			/* 
-			 * shift entries 
-			 */	
-			positionDB[i-1] = positionDB[i]; 
-		}
+		if(&positionDB[byAge[i]] == keep) continue;
+		dbRemove(&positionDB[byAge[i]]);
+		n--;
 	}
-	dbsize--;
-	positionDB = realloc(positionDB, sizeof(Neighbour)*dbsize);
-		
+	free(byAge);
 }
 
-/* 
- * prune oldest entry from the local db
- * only invoked in edge cases
+/*
+ * add the position in n to the history of nbp
  */
-static void pruneOldestRecord() 
+static void addHistory(Neighbour * nbp, NODELOCATION * n)
 {
-	uint64_t oldest = -1;
-	int oldestIndex = -1;
-	for(int i=0;i<dbsize;i++) 
+	if(nbp->historySize < HISTORY) nbp->historySize++;
+	memmove(&(nbp->history[1]), &(nbp->history[0]), 
+		sizeof(CnetPosition)*(nbp->historySize - 1));
+	memmove(&(nbp->historyTime[1]), &(nbp->historyTime[0]), 
+		sizeof(uint32_t)*(nbp->historySize - 1));
+	nbp->history[0] = n->loc;
+	nbp->historyTime[0] = n->timestamp;
+	nbp->heard = nodeinfo.time_in_usec;
+}
+
+/*
+ * Add a position to the positionDB, or update the existing 
+ * position if the address already exists. Returns the record,
+ * or NULL if the DB is full
+ */
+static Neighbour * savePosition(NODELOCATION n) 
+{
+	int h = findHash(n.addr);
+	if(addrMap[h] == NO_SLOT) 
+	{
+		if(numFree == 0) return NULL;
+		int slot = freeSlots[--numFree];
+		addrMap[h] = slot;
+		Neighbour * nbp = &positionDB[slot];
+		nbp->nl = n;
+		nbp->pred = 0;
+		nbp->lastBeacon = 0; 
+		nbp->interval = ORACLEINTERVAL;
+		nbp->viewSize = 0;
+		nbp->viewVersion = 0;
+		nbp->viewDigest = 0;
+		nbp->sent.version = 0;
+		nbp->refreshWanted = false;
+		nbp->fibEpoch = 0;
+		nbp->quality = 0;
+		nbp->fillRate = 0;
+		nbp->historySize = 0;
+		nbp->offsetKnown = false;
+		addHistory(nbp, &n);
+		nbp->member = dbsize;
+		members[dbsize++] = slot;
+		return nbp;
+	} 
+
+	/*
+	 * update location for this node if it's a newer reading
+	 */
+	Neighbour * nbp = &positionDB[addrMap[h]];
+	if(nbp->nl.timestamp < n.timestamp) 
 	{
-		if(positionDB[i].lastBeacon < oldest || oldestIndex == -1) 
+		bool moved = memcmp(&(nbp->nl.loc), &(n.loc), sizeof(CnetPosition)) != 0;
+		/*
+		 * a neighbour moving changes the routes it was a next
+		 * hop for or is a candidate for now, anything else only 
+		 * the routes towards it
+		 */
+		if(moved && isLive(nbp, nodeinfo.time_in_usec))
 		{
-			oldest = positionDB[i].lastBeacon;
-			oldestIndex = i;
+			nbp->nl.loc = n.loc;
+			dropFibsBy(nbp);
 		}
+		else if(moved)
+			nbp->fibEpoch = 0;
+		nbp->nl.loc = n.loc;
+		nbp->nl.timestamp = n.timestamp;
+		addHistory(nbp, &n);
+	}
+	return nbp;
+}
+
+/*
+ * merge the locations of the beacon p from nbp into the DB in one 
+ * go, first making room for the new ones if the DB is full
+ */
+static void mergeLocations(Neighbour * nbp, OraclePacket * p)
+{
+	int fresh = 0;
+	for(int i=0;i < p->locationsSize;i++) 
+	{
+		CnetAddr a = p->locations[i].addr;
+		if((int)a != (int)nodeinfo.nodenumber && p->locations[i].version != 0
+			&& lookup(a) == NULL)
+			fresh++;
+	}
+	if(fresh > numFree)
+		pruneDB(fresh - numFree, nbp);
+
+	for(int i=0;i < p->locationsSize;i++) 
+	{
+		/* 
+		 * if not THIS node, nor an entry the sender dropped
+		 */
+		if((int)p->locations[i].addr != (int)nodeinfo.nodenumber
+			&& p->locations[i].version != 0) 
+			savePosition(p->locations[i]);
 	}
-	dbRemove(oldestIndex);
 }
 
 /* 
- * prune old info from the db if it is overfull
- * no need to optimise this will only be invoked in edge cases
+ * checksum an oracle packet, return the result crc32
  */
-static void pruneDB() 
+static uint32_t checksum_oracle_packet(OraclePacket * p) 
 {
-	int n = dbsize - (MAX_ORACLE_PAYLOAD / sizeof(NODELOCATION));
-	for(int i=0;i<n;i++) 
+	p->checksum = 0;
+	return CNET_crc32((unsigned char*)p, sizeof(OraclePacket) 
+		- sizeof(p->locations) + sizeof(NODELOCATION)*p->locationsSize);
+}
+
+/*
+ * Work out the interval until our next beacon from our speed since 
+ * the last one, the neighbours which came and went since, and the 
+ * neighbours live now. It at most halves or doubles each time
+ */
+static CnetTime nextInterval()
+{
+	CnetTime t = nodeinfo.time_in_usec;
+	CnetPosition pos;
+	CNET_get_position(&pos, NULL);
+	double dx = pos.x - lastBeaconPos.x;
+	double dy = pos.y - lastBeaconPos.y;
+	double speed = sqrt(dx*dx + dy*dy) * 1000000 / (t - lastBeaconTime + 1);
+	lastBeaconPos = pos;
+	lastBeaconTime = t;
+
+	int live = 0;
+	for(int i=0;i<dbsize;i++) 
 	{
-		pruneOldestRecord();
+		if(isLive(MEMBER(i), t)) live++;
 	}
+	int churn = contacts + 
+		(lastLive + contacts > live ? lastLive + contacts - live : 0);
+	lastLive = live;
+	contacts = 0;
+
+	double next = speed > 0 ? BEACON_MOVE * 1000000 / speed : BEACON_MAX_INTERVAL;
+	next = next / (1 + churn) * (1 + (double)live / BEACON_CROWD);
+	if(next < interval / 2) next = interval / 2;
+	if(next > interval * 2) next = interval * 2;
+	if(next < BEACON_MIN_INTERVAL) next = BEACON_MIN_INTERVAL;
+	if(next > BEACON_MAX_INTERVAL) next = BEACON_MAX_INTERVAL;
+	return (CnetTime)next;
 }
 
 /* 
@@ -192,99 +766,518 @@ static void pruneDB()
 EVENT_HANDLER(sendOracleBeacon)
 {
 	OraclePacket p;
+
 	/* 
-	 * if cant send our DB in one beacon, then prune the DB 
+	 * give the entries which changed since the last beacon a new
+	 * version
+	 */
+	int changes = numDropped;
+	for(int i=0;i<dbsize;i++) 
+	{
+		Neighbour * nbp = MEMBER(i);
+		NODELOCATION adv = nbp->nl;
+#if ROUTING == ROUTE_PROPHET
+		adv.pred = nbp->pred;
+#elif ROUTING == ROUTE_BACKPRESSURE
+		adv.backlog = net_backlog(adv.addr);
+#endif
+		adv.version = nbp->sent.version;
+		bool changed = adv.version == 0 || 
+			memcmp(&adv, &(nbp->sent), sizeof(NODELOCATION)) != 0;
+		if(changed)
+		{
+			if(adv.version != 0)
+				dbDigest -= entryHash(adv.addr, adv.version);
+			adv.version = ++dbVersion;
+			dbDigest += entryHash(adv.addr, adv.version);
+			nbp->sent = adv;
+			changes++;
+		}
+	}
+
+	/*
+	 * a delta lists the dropped entries and then the changed ones,
+	 * a full beacon all entries. If the delta wouldn't fit, send 
+	 * a full beacon. Our whole db always fits
 	 */
-	if(dbsize > (MAX_ORACLE_PAYLOAD / sizeof(NODELOCATION))) 
+	bool full = fullWanted || ++sinceFull >= BEACON_FULL_EVERY || 
+		changes > DB_SIZE;
+	int n = 0;
+	for(int i=0;!full && i<numDropped;i++)
 	{
-		pruneDB();
+		memset(&(p.locations[n]), 0, sizeof(NODELOCATION));
+		p.locations[n++].addr = dropped[i];
 	}
+	numDropped = 0;
+	for(int i=0;i<dbsize;i++)
+	{
+		if(full || MEMBER(i)->sent.version > lastBeaconVersion)
+			p.locations[n++] = MEMBER(i)->sent;
+	}
+	p.flags = full ? BEACON_FULL : 0;
 
-	/* 
-	 * copy our db to the packet 
+	/*
+	 * ask the neighbours whose views we lost for full beacons, all
+	 * of them at once if it is more than one
 	 */
-	for(int i=0;i<dbsize;i++) 
+	p.refresh = 0;
+	for(int i=0;i<dbsize;i++)
+	{
+		Neighbour * nbp = MEMBER(i);
+		if(!nbp->refreshWanted) continue;
+		nbp->refreshWanted = false;
+		p.refresh = (p.flags & BEACON_REFRESH) ? REFRESH_ALL : nbp->nl.addr;
+		p.flags |= BEACON_REFRESH;
+	}
+	p.version = dbVersion;
+	p.base = full ? 0 : lastBeaconVersion;
+	p.digest = dbDigest;
+	lastBeaconVersion = dbVersion;
+	if(full)
 	{
-		p.locations[i] = positionDB[i].nl;
+		sinceFull = 0;
+		fullWanted = false;
+		beacons.full++;
 	}
+	else
+		beacons.delta++;
 	p.freeBufferSpace = get_public_nbytes_free();
-	p.locationsSize = dbsize;
+	p.locationsSize = n;
+	interval = nextInterval();
+	p.interval = interval;
 	p.senderLocation.addr = nodeinfo.nodenumber;
 	CnetPosition loc;
 	CNET_get_position(&loc, NULL);
 	p.senderLocation.loc = loc;
 	p.senderLocation.timestamp = nodeinfo.time_in_usec/1000000;
+	p.senderLocation.version = 0;
+#if ROUTING == ROUTE_PROPHET
+	p.senderLocation.pred = 1;
+#elif ROUTING == ROUTE_BACKPRESSURE
+	p.senderLocation.backlog = 0;
+#endif
 	char * pp = (char *)(&(p));	
 	p.checksum = checksum_oracle_packet(&p);
-	int len = sizeof(p) - sizeof(p.locations) + sizeof(NODELOCATION)*dbsize;
-	assert(len < MAX_PACKET_SIZE);
+	int len = sizeof(p) - sizeof(p.locations) + sizeof(NODELOCATION)*n;
+	assert(len <= MAX_PACKET_SIZE);
+	beacons.entries += n;
+	beacons.bytes += len;
+	beacons.intervals += interval;
 	link_send_info(pp, len, ALLNODES);
 	/* 
 	 * send again later 
 	 */
-	CNET_start_timer(EV_TIMER7, (CnetTime)ORACLEINTERVAL, 0);
+	CNET_start_timer(EV_TIMER7, interval, 0);
+}
+
+/*
+ * age all our delivery predictabilities by PROPHET_GAMMA for 
+ * every PROPHET_AGE_UNIT passed since they were last aged
+ */
+static void agePredictabilities()
+{
+	CnetTime t = nodeinfo.time_in_usec;
+	int k = (t - lastAged) / PROPHET_AGE_UNIT;
+	if(k <= 0) return;
+	float g = pow(PROPHET_GAMMA, k);
+	for(int i=0;i<dbsize;i++) 
+	{
+		MEMBER(i)->pred *= g;
+	}
+	lastAged += (CnetTime)k * PROPHET_AGE_UNIT;
+}
+
+/*
+ * compare function for bsearch on a neighbour's view
+ */
+static int compareView(const void * key, const void * elem)
+{
+	uint32_t k = *((uint32_t *)key);
+	uint32_t addr = (uint32_t)(((VIEWENTRY *)(elem))->addr);
+	return k-addr ;
+}
+
+/*
+ * the delivery predictability neighbour nbp has for dest, 
+ * as of its last beacon
+ */
+static float viewPred(Neighbour * nbp, CnetAddr dest)
+{
+	if(nbp->nl.addr == dest) return 1;
+	VIEWENTRY * v = bsearch(&dest, nbp->view, 
+		nbp->viewSize, sizeof(VIEWENTRY), compareView);
+	return v == NULL ? 0 : v->pred;
+}
+
+/*
+ * the bytes neighbour nbp has buffered for dest, as of 
+ * its last beacon
+ */
+static uint32_t viewBacklog(Neighbour * nbp, CnetAddr dest)
+{
+	if(nbp->nl.addr == dest) return 0;
+	VIEWENTRY * v = bsearch(&dest, nbp->view, 
+		nbp->viewSize, sizeof(VIEWENTRY), compareView);
+	return v == NULL ? 0 : v->backlog;
+}
+
+/*
+ * Bring our copy of nbp's view up to date with its beacon p: a full
+ * beacon replaces it, a delta updates and removes entries in it, 
+ * keeping it sorted by address. The view only grows when it needs more room 
+ * than it ever has before. Returns false if the copy is out of date,
+ * because a beacon was missed or the digests differ
+ */
+static bool saveView(Neighbour * nbp, OraclePacket * p)
+{
+	bool full = p->flags & BEACON_FULL;
+	if(full)
+	{
+		nbp->viewSize = 0;
+		nbp->viewDigest = 0;
+	}
+	if(nbp->viewCapacity < nbp->viewSize + p->locationsSize)
+	{
+		nbp->viewCapacity = nbp->viewSize + p->locationsSize;
+		nbp->view = realloc(nbp->view, sizeof(VIEWENTRY)*nbp->viewCapacity);
+	}
+	for(int i=0;i < p->locationsSize;i++) 
+	{
+		NODELOCATION * c = &(p->locations[i]);
+		VIEWENTRY * v;
+		if(full)
+		{
+			v = &(nbp->view[nbp->viewSize++]);
+		}
+		else
+		{
+			/*
+			 * find the entry, or the place to insert it
+			 */
+			int lo = 0, hi = nbp->viewSize;
+			while(lo < hi)
+			{
+				int mid = (lo + hi) / 2;
+				if((uint32_t)nbp->view[mid].addr < (uint32_t)c->addr) lo = mid + 1;
+				else hi = mid;
+			}
+			v = &(nbp->view[lo]);
+			bool found = lo < nbp->viewSize && v->addr == c->addr;
+			if(found)
+				nbp->viewDigest -= entryHash(v->addr, v->version);
+			if(c->version == 0)
+			{
+				/*
+				 * the sender dropped its entry
+				 */
+				if(found)
+				{
+					memmove(v, v + 1, sizeof(VIEWENTRY)*(nbp->viewSize - lo - 1));
+					nbp->viewSize--;
+				}
+				continue;
+			}
+			if(!found)
+			{
+				memmove(v + 1, v, sizeof(VIEWENTRY)*(nbp->viewSize - lo));
+				nbp->viewSize++;
+			}
+		}
+		v->addr = c->addr;
+#if ROUTING == ROUTE_PROPHET
+		v->pred = c->pred;
+#elif ROUTING == ROUTE_BACKPRESSURE
+		v->backlog = c->backlog;
+#endif
+		v->version = c->version;
+		nbp->viewDigest += entryHash(v->addr, v->version);
+	}
+	if(full && nbp->viewSize > 0)
+		qsort(nbp->view, nbp->viewSize, sizeof(VIEWENTRY), compareView);
+
+	bool inSync = (full || p->base == nbp->viewVersion) && 
+		nbp->viewDigest == p->digest;
+	nbp->viewVersion = p->version;
+	return inSync;
+}
+
+/*
+ * PRoPHET update on a beacon from nbp: direct update for the
+ * sender and transitive update for every node in its view
+ */
+static void updatePredictabilities(Neighbour * nbp)
+{
+	agePredictabilities();
+
+	float * pb = &(nbp->pred);
+	*pb += (1 - *pb) * PROPHET_P_INIT;
+
+	for(int i=0;i < nbp->viewSize;i++) 
+	{
+		VIEWENTRY * c = &(nbp->view[i]);
+		if((int)c->addr == (int)nodeinfo.nodenumber || c->addr == nbp->nl.addr) 
+			continue;
+		Neighbour * ncp = lookup(c->addr);
+		float trans = *pb * c->pred * PROPHET_BETA;
+		if(ncp != NULL && ncp->pred < trans) 
+			ncp->pred = trans;
+	}
 }
 
 /* 
  * process an oracle packet and update local knowledge
  * database
+ *
+ * returns true if the sender was not live before this beacon,
+ * i.e. this beacon starts a new contact
  */
-static void processBeacon(OraclePacket * p) 
+static bool processBeacon(OraclePacket * p) 
 {
-	for(int i=0;i < p->locationsSize;i++) 
+	/* 
+	 * save some near-neighbour specific info, making room
+	 * for the sender first if need be
+	 */
+	if(numFree == 0 && lookup(p->senderLocation.addr) == NULL)
+		pruneDB(1, NULL);
+	Neighbour * nbp = savePosition(p->senderLocation);
+	CnetTime t = nodeinfo.time_in_usec;
+	bool contact = !isLive(nbp, t);
+	if(contact)
 	{
-		/* 
-		 * if not THIS node 
+		nbp->quality = LQ_INITIAL;
+		nbp->fillRate = 0;
+		contacts++;
+	}
+	else
+	{
+		/*
+		 * count the beacons missed since the last one, at the 
+		 * interval it advertised then
 		 */
-		if((int)p->locations[i].addr != (int)nodeinfo.nodenumber) 
-			savePosition(p->locations[i]);
+		int missed = (t - nbp->lastBeacon + nbp->interval/2) / nbp->interval - 1;
+		if(missed < 0) missed = 0;
+		float q = (1 - LQ_ALPHA) * nbp->quality + LQ_ALPHA / (1 + missed);
+		bool changed = fabs(q - nbp->quality) > LQ_STEP;
+		nbp->quality = q;
+		if(changed) dropFibsBy(nbp);
+
+		float rate = ((float)nbp->freeBufferSpace - p->freeBufferSpace) 
+			* 1000000 / (t - nbp->lastBeacon + 1);
+		nbp->fillRate = (1 - FILL_ALPHA) * nbp->fillRate + FILL_ALPHA * rate;
 	}
+	bool changed = contact || nbp->freeBufferSpace != p->freeBufferSpace;
+	nbp->lastBeacon = t;
+	nbp->freeBufferSpace = p->freeBufferSpace;
+	if(changed) dropFibsBy(nbp);
+	nbp->clockOffset = t - (CnetTime)p->senderLocation.timestamp * 1000000;
+	nbp->offsetKnown = true;
+	nbp->interval = p->interval;
+	if(nbp->interval < BEACON_MIN_INTERVAL) nbp->interval = BEACON_MIN_INTERVAL;
+	if(nbp->interval > BEACON_MAX_INTERVAL) nbp->interval = BEACON_MAX_INTERVAL;
 
-	/* 
-	 * save some near-neighbour specific info 
+	/*
+	 * the sender is not dropped to make room for what it tells us
 	 */
-	savePosition(p->senderLocation);
-	Neighbour * nbp = bsearch(&(p->senderLocation.addr), 
-		positionDB, dbsize, sizeof(Neighbour), compareNL);
-	nbp->lastBeacon = nodeinfo.time_in_usec; 
-	nbp->freeBufferSpace = p->freeBufferSpace;
+	mergeLocations(nbp, p);
+	if(!saveView(nbp, p))
+	{
+		nbp->refreshWanted = true;
+		beacons.refreshes++;
+	}
+	if((p->flags & BEACON_REFRESH) && (p->refresh == REFRESH_ALL ||
+		(int)p->refresh == (int)nodeinfo.nodenumber))
+		fullWanted = true;
+	if(ROUTING == ROUTE_PROPHET)
+		updatePredictabilities(nbp);
+	return contact;
+}
+
+/*
+ * where the node of record dp is expected to be now, from its
+ * last position and its velocity. Sets radius to how far from 
+ * there it may be
+ */
+static CnetPosition predictPosition(Neighbour * dp, double * radius)
+{
+	CnetTime t = nodeinfo.time_in_usec;
+	CnetTime seen = dp->offsetKnown ? 
+		(CnetTime)dp->nl.timestamp * 1000000 + dp->clockOffset : dp->heard;
+	double age = t > seen ? (t - seen) / 1000000.0 : 0;
+	*radius = age * UNCERTAINTY_RATE;
+	if(*radius > UNCERTAINTY_MAX) *radius = UNCERTAINTY_MAX;
+
+	/*
+	 * the velocity between the newest position and the oldest 
+	 * within HISTORY_SPAN of it
+	 */
+	CnetPosition p = dp->nl.loc;
+	int k = 0;
+	for(int i=1;i<dp->historySize;i++) 
+	{
+		if(dp->historyTime[0] - dp->historyTime[i] > HISTORY_SPAN) break;
+		k = i;
+	}
+	if(k == 0) return p;
+	double span = dp->historyTime[0] - dp->historyTime[k];
+	double ahead = age < span ? age : span;
+	p.x += (dp->history[0].x - dp->history[k].x) * ahead / span;
+	p.y += (dp->history[0].y - dp->history[k].y) * ahead / span;
+	return p;
 }
 
 /* 
- * find the last known position of a node (a), sets l
- * equal to the last known position
+ * find the expected position of a node (a) and how far from
+ * there it may be, sets l and radius to them
  * returns false if unknown
  */
-static bool queryPosition(CnetPosition * l, CnetAddr a) 
+static bool queryPosition(CnetPosition * l, double * radius, CnetAddr a) 
 {
-	Neighbour * nbp = bsearch(&a, positionDB, 
-		dbsize, sizeof(Neighbour), compareNL);
+	Neighbour * nbp = lookup(a);
 	if(nbp==NULL) 
 	{
 		return false;
 	} 
 	else 
 	{
-		*l = nbp->nl.loc;
+		*l = predictPosition(nbp, radius);
 		return true;
 	}
 }
 
-/* 
- * returns true iff: 
- * 	a->c > b->c
- * 	by some interval defined in dtn.h
+/*
+ * PRoPHET version of get_nth_best_node: the live neighbours with
+ * room for the message ranked by their delivery predictability for
+ * dest, the destination itself first, and only those whose 
+ * predictability is higher than ours. Returns the n'th of them
  */
-bool isCloser(CnetPosition a, CnetPosition b, CnetPosition c, int interval) 
+static bool prophetBestNode(CnetAddr * ptr, int n, 
+	CnetAddr dest, size_t message_size)
 {
-	int cax = c.x - a.x;
-	int cay = c.y - a.y;
-	int cbx = c.x - b.x;
-	int cby = c.y - b.y;
-	if( cbx*cbx + cby*cby + interval*interval < cax*cax + cay*cay )
-		return true;
-	else 
-		return false;
+	if(n >= FIB_WAYS) return false;
+	CnetTime t = nodeinfo.time_in_usec;
+	agePredictabilities();
+	Neighbour * dp = lookup(dest);
+	float ours = (dp == NULL) ? 0 : dp->pred;
+	float preds[FIB_WAYS];
+	CnetAddr ranked[FIB_WAYS];
+	int size = 0;
+	for(int i=0; i<dbsize;i++) 
+	{
+		Neighbour * nbp = MEMBER(i);
+		if(!isLive(nbp, t)) continue;
+		if((int)nbp->freeBufferSpace < message_size) continue; 
+		float pred = nbp->nl.addr == dest ? HUGE_VAL : viewPred(nbp, dest);
+		if(pred <= ours) continue;
+
+		/*
+		 * insert in order, keeping the best n+1
+		 */
+		int j = size <= n ? size++ : n + 1;
+		for(; j>0 && preds[j-1] < pred; j--) 
+		{
+			if(j <= n) 
+			{
+				preds[j] = preds[j-1];
+				ranked[j] = ranked[j-1];
+			}
+		}
+		if(j <= n) 
+		{
+			preds[j] = pred;
+			ranked[j] = nbp->nl.addr;
+		}
+	}
+	if(size <= n) return false;
+	*ptr = ranked[n];
+	return true;
+}
+
+/*
+ * the free buffer space neighbour nbp is expected to have left
+ * by the time it goes quiet if it keeps filling up at its current 
+ * rate
+ */
+static double headroom(Neighbour * nbp)
+{
+	double space = nbp->freeBufferSpace;
+	if(nbp->fillRate > 0)
+		space -= nbp->fillRate * liveWait(nbp) / 1000000;
+	return space > 0 ? space : 0;
+}
+
+/*
+ * how good a next hop neighbour nbp is for packets to the node of
+ * record dp, expected at destPos within radius, 0 if it is no good
+ * at all. backlog is our own queue for dp (backpressure only)
+ */
+static double score(Neighbour * nbp, Neighbour * dp, CnetPosition destPos,
+	double radius, CnetPosition myPos, double backlog)
+{
+	if(nbp == dp) return HUGE_VAL;
+	if(!makesProgress(myPos, nbp->nl.loc, destPos, radius)) return 0;
+	if(ROUTING == ROUTE_BACKPRESSURE)
+	{
+		double gradient = backlog - viewBacklog(nbp, dp->nl.addr);
+		double space = headroom(nbp);
+		if(gradient <= 0) return 0;
+		return gradient * nbp->quality * space / (space + BUFFER_KNEE);
+	}
+	double progress = distance(myPos, destPos) - distance(nbp->nl.loc, destPos);
+	double space = nbp->freeBufferSpace;
+	return progress * nbp->quality * space / (space + BUFFER_KNEE);
+}
+
+/*
+ * rebuild the cached next hops towards the node of record dp:
+ * the FIB_WAYS best scoring live neighbours, best first. The 
+ * expected position moves on, so the cache expires after 
+ * ORACLEINTERVAL
+ */
+static void buildFib(Neighbour * dp, CnetPosition myPos, double backlog)
+{
+	CnetTime t = nodeinfo.time_in_usec;
+	double scores[FIB_WAYS];
+	dp->fibSize = 0;
+	dp->fibEpoch = epoch;
+	dp->fibExpires = t + ORACLEINTERVAL;
+
+	double radius;
+	CnetPosition destPos = predictPosition(dp, &radius);
+	dp->fibDest = destPos;
+	dp->fibRadius = radius;
+	for(int i=0; i<dbsize;i++) 
+	{
+		Neighbour * nbp = MEMBER(i);
+		/* 
+		 * skip this neighbour if we haven't had a beacon from it recently 
+		 */ 
+		if(!isLive(nbp, t)) continue; 
+		double sc = score(nbp, dp, destPos, radius, myPos, backlog);
+		if(sc <= 0) continue;
+		if(nbp->lastBeacon + liveWait(nbp) < dp->fibExpires)
+			dp->fibExpires = nbp->lastBeacon + liveWait(nbp);
+
+		/*
+		 * insert in order, dropping the worst if full
+		 */
+		int j = dp->fibSize < FIB_WAYS ? dp->fibSize++ : FIB_WAYS;
+		for(; j>0 && scores[j-1] < sc; j--) 
+		{
+			if(j < FIB_WAYS) 
+			{
+				scores[j] = scores[j-1];
+				dp->fib[j] = dp->fib[j-1];
+				dp->fibSpace[j] = dp->fibSpace[j-1];
+			}
+		}
+		if(j < FIB_WAYS) 
+		{
+			scores[j] = sc;
+			dp->fib[j] = nbp->nl.addr;
+			dp->fibSpace[j] = ROUTING == ROUTE_BACKPRESSURE ? 
+				headroom(nbp) : nbp->freeBufferSpace;
+		}
+	}
 }
 
 /* 
@@ -298,51 +1291,111 @@ bool isCloser(CnetPosition a, CnetPosition b, CnetPosition c, int interval)
  * This function will only 'recommend' a node which is in range and
  * has buffer space to transmit. 
  *
- * Note: function will currently recommend broadcasting to ANY node
- * which causes an improvement, rather than greedily trying to find
- * the BEST node.
+ * Candidates are ranked best first: the destination itself, then
+ * by progress weighted by link quality and free buffer space. n
+ * skips that many candidates which have room for the message.
  *
  */
 bool get_nth_best_node(CnetAddr * ptr, int n, 
 	CnetAddr dest, size_t message_size) 
 {
-	CnetTime t = nodeinfo.time_in_usec;
-	CnetPosition destPos;  
-	if(!queryPosition(&destPos, dest)) 
+	if(ROUTING == ROUTE_PROPHET)
+		return prophetBestNode(ptr, n, dest, message_size);
+
+	Neighbour * dp = lookup(dest);
+	if(dp == NULL) 
 	{
 		return false;
 	}
-	if(n!=0) return false;
-	else 
+
+	/*
+	 * our own moves change every route, once they add up to FIB_MOVE
+	 */
+	CnetPosition myPos; CNET_get_position(&myPos, NULL);	
+	if(distance(myPos, fibPos) > FIB_MOVE)
+	{
+		fibPos = myPos;
+		epoch++;
+	}
+	if(ROUTING == ROUTE_BACKPRESSURE)
 	{
-		for(int i=0; i<dbsize;i++) 
+		/*
+		 * our backlog changes with every packet, so the ranking is
+		 * never cached. The packet being routed is part of our 
+		 * queue even if it has not been buffered yet
+		 */
+		double backlog = net_backlog(dest);
+		if(backlog < message_size) backlog = message_size;
+		buildFib(dp, myPos, backlog);
+		dp->fibEpoch = 0;
+	}
+	else if(dp->fibEpoch != epoch || nodeinfo.time_in_usec > dp->fibExpires)
+		buildFib(dp, fibPos, 0);
+
+	for(int i=0;i<dp->fibSize;i++) 
+	{
+		/*
+		 * enough buffer space for this massage
+		 */
+		if((int)dp->fibSpace[i] < message_size) continue; 
+		/*
+		 * the cache may have been found up to FIB_MOVE from here, 
+		 * so a hop must still make progress from where we are
+		 */
+		if(dp->fib[i] != dest)
 		{
-			/* 
-			 * skip this neighbour if we haven't had a beacon from it recently 
-			 */ 
-			if(t > positionDB[i].lastBeacon + ORACLEWAIT ) continue; 
-			/*
-			 * enough buffer space for this massage
-			 */
-			if((int)positionDB[i].freeBufferSpace < message_size) continue; 
-			CnetPosition nextPos = positionDB[i].nl.loc;
-			CnetPosition myPos; CNET_get_position(&myPos, NULL);	
-			if( positionDB[i].nl.addr == dest ) 
-			{	
-				*ptr = positionDB[i].nl.addr;
-				return true;
-			}
-			else if( isCloser(myPos, nextPos, destPos, MINDIST) ) 
-			{
-				*ptr = positionDB[i].nl.addr;
-				return *ptr != nodeinfo.nodenumber;
-			}
+			Neighbour * nbp = lookup(dp->fib[i]);
+			if(nbp == NULL || !makesProgress(myPos, nbp->nl.loc, 
+				dp->fibDest, dp->fibRadius)) 
+				continue;
 		}
+		if(n-- > 0) continue;
+		*ptr = dp->fib[i];
+		return true;
 	}
 	return false;
 
 }
 
+/*
+ * returns true if via is a live neighbour with buffer space for the
+ * message, and handing the message to via is either direct delivery
+ * or makes progress towards the expected position of dest.
+ * If no position is known for dest then any live neighbour will do.
+ *
+ * Used by the multi-copy engines, which pick their own carriers.
+ */
+bool is_good_carrier(CnetAddr via, CnetAddr dest, size_t message_size)
+{
+	if(via == nodeinfo.nodenumber) return false;
+	Neighbour * nbp = lookup(via);
+	if(nbp == NULL || !isLive(nbp, nodeinfo.time_in_usec)) return false;
+	if((int)nbp->freeBufferSpace < message_size) return false;
+	if(via == dest) return true;
+
+	CnetPosition destPos;
+	double radius;
+	if(!queryPosition(&destPos, &radius, dest)) return true;
+	CnetPosition myPos; CNET_get_position(&myPos, NULL);
+	return makesProgress(myPos, nbp->nl.loc, destPos, radius);
+}
+
+/*
+ * returns the most free buffer space offered by any live 
+ * neighbour in its last beacon, 0 if there are none
+ */
+int get_neighbour_nbytes_free()
+{
+	CnetTime t = nodeinfo.time_in_usec;
+	uint32_t most = 0;
+	for(int i=0;i<dbsize;i++) 
+	{
+		if(isLive(MEMBER(i), t) && MEMBER(i)->freeBufferSpace > most)
+			most = MEMBER(i)->freeBufferSpace;
+	}
+	return most;
+}
+
 /* 
  * Messages from other nodes which use link_send_info will
  * be passed up to here from the data link layer 
@@ -360,18 +1413,64 @@ void oracle_recv(char * msg, int len, CnetAddr rcv)
 	}
 	if(checksum_oracle_packet(p)==oldsum) 
 	{
-		processBeacon(p);
+		if(processBeacon(p))
+			net_neighbour_up(p->senderLocation.addr);
 	}
 	net_send_buffered();
 }
 
+/*
+ * Print the beacon statistics of this node, called at shutdown
+ */
+void oracle_report()
+{
+	int sent = beacons.full + beacons.delta;
+	printf("node %d beacons: full %d, delta %d, entries %d, bytes %d, "
+		"full beacons asked for %d, average interval %lld usec\n", 
+		nodeinfo.nodenumber, beacons.full, beacons.delta, beacons.entries, 
+		beacons.bytes, beacons.refreshes, 
+		(long long)(sent > 0 ? beacons.intervals / sent : 0));
+}
+
 /* 
  * function is called on program intialisation 
  */
 void oracle_init() 
 {
+	positionDB = malloc(sizeof(Neighbour)*DB_SIZE);
+	members = malloc(sizeof(int)*DB_SIZE);
+	freeSlots = malloc(sizeof(int)*DB_SIZE);
 	dbsize = 0;
-	positionDB = NULL;
+	numFree = DB_SIZE;
+	for(int i=0;i<DB_SIZE;i++) 
+	{
+		positionDB[i].view = NULL;
+		positionDB[i].viewCapacity = 0;
+		freeSlots[i] = DB_SIZE - 1 - i;
+	}
+	for(hashSize = 1; hashSize < 2*DB_SIZE; hashSize *= 2)
+		;
+	addrMap = malloc(sizeof(int)*hashSize);
+	for(int i=0;i<hashSize;i++) 
+	{
+		addrMap[i] = NO_SLOT;
+	}
+	lastAged = nodeinfo.time_in_usec;
+	epoch = 1;
+	CNET_get_position(&fibPos, NULL);
+	dropped = malloc(sizeof(CnetAddr)*DB_SIZE);
+	numDropped = 0;
+	dbVersion = 0;
+	lastBeaconVersion = 0;
+	dbDigest = 0;
+	sinceFull = 0;
+	fullWanted = false;
+	memset(&beacons, 0, sizeof(beacons));
+	interval = ORACLEINTERVAL;
+	lastBeaconPos = fibPos;
+	lastBeaconTime = nodeinfo.time_in_usec;
+	lastLive = 0;
+	contacts = 0;
 
 	CNET_srand(nodeinfo.time_of_day.sec + nodeinfo.nodenumber);
 	/* 
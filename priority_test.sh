@@ -0,0 +1,41 @@
+#!/bin/bash
+#
+# usage: priority_test.sh [compile flags]
+# e.g.   priority_test.sh -DCUSTODY=1
+#
+# Runs the message frequency sweep, then PRIORITY/PRIO0 to PRIO3 which
+# carry on from it to a message every 62.5 ms so the bulk messages
+# saturate the network, and reports, for each message class (high,
+# normal, low), the messages delivered and their average delivery time
+# in seconds, to see how well the short urgent messages get through.
+# The first column is the time between messages in seconds.
+#
+DURATION="5m"
+FLAGS="$1"
+RESULT=result.priority`echo "$FLAGS" | tr -cs 'A-Za-z0-9_' '.'`
+RESULT=${RESULT%.}
+#
+rm -f $RESULT
+#
+for f in MESSAGEFREQ/FREQ{0..9} PRIORITY/PRIO{0..3}
+do
+	TOPOLOGY=$f
+	if [ -n "$FLAGS" ]
+	then
+		sed "s/^\(compile[^\"]*\"\)/\1$FLAGS /" $TOPOLOGY > $TOPOLOGY.flags
+		TOPOLOGY=$TOPOLOGY.flags
+	fi
+	cnet -W -q -T -e $DURATION -s -Q $TOPOLOGY	| 
+	awk -v rate=`grep '^messagerate' $f | tr -dc '0-9' | awk '{ print $1 / 1000000 }'` '
+		/class [0-9] messages:/ {
+			c = $4; sub(",", "", $7)
+			n[c] += $7; t[c] += $10
+		}
+		END {
+			printf "%s", rate
+			for(c = 0; c < 3; c++)
+				printf " %d %.2f", n[c], n[c] ? t[c] / n[c] / 1000000 : 0
+			printf "\n"
+		}'
+	rm -f $f.flags
+done > $RESULT
@@ -0,0 +1,318 @@
+/* this file keeps the packets of the network layer's buffers on
+ * disk, so that they survive a reboot of the node and so that a
+ * node can buffer far more than fits in memory.
+ *
+ * The store is an append-only log split into fixed size segment
+ * files, each of which is memory mapped. A packet is appended as
+ * a record (a small header followed by the packet) and the network
+ * layer works on the packet in place in the mapping. When the packet
+ * leaves the buffer its record is marked dead.
+ *
+ * The in-memory index is just the table of segments and the live
+ * bytes in each. Rebuilding it on reboot only reads record headers,
+ * skipping over the packets themselves.
+ *
+ * A segment with no live records left is deleted. When the last free
+ * segment is taken, the segment with the fewest live bytes is
+ * compacted by moving its live records to the newest segment.
+ */
+#include "dtn.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STORE_MAGIC 0x44544e53 /* "DTNS" */
+
+#define RECORD_LIVE 1
+#define RECORD_DEAD 2
+
+/*
+ * header in front of every packet in a segment
+ */
+typedef struct
+{
+	uint32_t magic;
+	uint32_t flags;
+	/*
+	 * bytes of packet following the header
+	 */
+	uint32_t len;
+	uint32_t pad;
+} RECORDHEADER;
+
+/* records are kept 8 byte aligned so packets can be used in place */
+#define RECORD_SIZE(len) ((sizeof(RECORDHEADER) + (len) + 7) & ~7)
+
+/*
+ * a segment file and what we know about it
+ */
+typedef struct
+{
+	char * base;
+	/*
+	 * bytes of the segment written so far
+	 */
+	size_t used;
+	/*
+	 * bytes and number of live records in the segment
+	 */
+	size_t liveBytes;
+	int liveRecords;
+} SEGMENT;
+
+static SEGMENT segments[STORE_MAX_SEGMENTS];
+
+/*
+ * the segment records are appended to, -1 if none
+ */
+static int active;
+
+/*
+ * called with the old and new address of each packet moved
+ * during compaction
+ */
+static void (*moved)(PACKET * from, PACKET * to);
+
+/*
+ * file name of segment n of this node
+ */
+static void segmentName(char * name, int n)
+{
+	sprintf(name, "%s/store-%d-%d", LOGDIR, nodeinfo.nodenumber, n);
+}
+
+/*
+ * map segment n, creating its file if create is set.
+ * returns false if that is not possible
+ */
+static bool mapSegment(int n, bool create)
+{
+	char name[BUFSIZ];
+	segmentName(name, n);
+	int fd = open(name, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644);
+	if(fd < 0) return false;
+	if(create && ftruncate(fd, STORE_SEGMENT_SIZE) != 0)
+	{
+		close(fd);
+		return false;
+	}
+	char * base = mmap(NULL, STORE_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED) return false;
+
+	segments[n].base = base;
+	segments[n].used = 0;
+	segments[n].liveBytes = 0;
+	segments[n].liveRecords = 0;
+	return true;
+}
+
+/*
+ * unmap and delete segment n
+ */
+static void dropSegment(int n)
+{
+	char name[BUFSIZ];
+	munmap(segments[n].base, STORE_SEGMENT_SIZE);
+	segments[n].base = NULL;
+	segmentName(name, n);
+	unlink(name);
+	if(active == n) active = -1;
+}
+
+/*
+ * find the segment holding a packet, -1 if it is not in the store
+ */
+static int segmentOf(PACKET * pack)
+{
+	char * p = (char *)pack;
+	for(int i=0;i<STORE_MAX_SEGMENTS;i++)
+	{
+		if(segments[i].base != NULL && p >= segments[i].base
+			&& p < segments[i].base + STORE_SEGMENT_SIZE)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * append a live record holding pack to segment n,
+ * returns the packet in the store or NULL if it doesn't fit
+ */
+static PACKET * append(int n, PACKET * pack)
+{
+	size_t len = PACKET_HEADER_SIZE + pack->h.len;
+	SEGMENT * s = &segments[n];
+	if(s->used + RECORD_SIZE(len) > STORE_SEGMENT_SIZE) return NULL;
+
+	RECORDHEADER * r = (RECORDHEADER *)(s->base + s->used);
+	memcpy(r + 1, pack, len);
+	r->len = len;
+	r->flags = RECORD_LIVE;
+	r->pad = 0;
+	r->magic = STORE_MAGIC;
+	s->used += RECORD_SIZE(len);
+	s->liveBytes += RECORD_SIZE(len);
+	s->liveRecords++;
+	return (PACKET *)(r + 1);
+}
+
+/*
+ * move the live records of segment n to the active segment, as far
+ * as they fit, and delete n if that emptied it
+ */
+static void compact(int n)
+{
+	SEGMENT * s = &segments[n];
+	size_t off = 0;
+	while(off < s->used && s->liveRecords > 0)
+	{
+		RECORDHEADER * r = (RECORDHEADER *)(s->base + off);
+		off += RECORD_SIZE(r->len);
+		if(r->flags != RECORD_LIVE) continue;
+
+		PACKET * to = append(active, (PACKET *)(r + 1));
+		if(to == NULL) return;
+		r->flags = RECORD_DEAD;
+		s->liveBytes -= RECORD_SIZE(r->len);
+		s->liveRecords--;
+		moved((PACKET *)(r + 1), to);
+	}
+	if(s->liveRecords == 0) dropSegment(n);
+}
+
+/*
+ * start appending to a new segment. If that takes the last free
+ * slot, compact the segment with the fewest live bytes into it.
+ * returns false if there is no room for a new segment
+ */
+static bool newSegment()
+{
+	int n = -1;
+	int freeSlots = 0;
+	for(int i=0;i<STORE_MAX_SEGMENTS;i++)
+	{
+		if(segments[i].base == NULL)
+		{
+			freeSlots++;
+			if(n == -1) n = i;
+		}
+	}
+	if(n == -1 || !mapSegment(n, true)) return false;
+	active = n;
+
+	if(freeSlots == 1)
+	{
+		int victim = -1;
+		for(int i=0;i<STORE_MAX_SEGMENTS;i++)
+		{
+			if(i == active || segments[i].base == NULL) continue;
+			if(victim == -1 || segments[i].liveBytes < segments[victim].liveBytes)
+				victim = i;
+		}
+		if(victim != -1) compact(victim);
+	}
+	return true;
+}
+
+/*
+ * Copy a packet into the store. Returns the packet in the store,
+ * which the caller should use instead of its own copy, or NULL if
+ * the store is full.
+ */
+PACKET * store_put(PACKET * pack)
+{
+	PACKET * p = NULL;
+	if(active != -1) p = append(active, pack);
+	if(p == NULL && newSegment()) p = append(active, pack);
+	return p;
+}
+
+/*
+ * returns true if the packet is held in the store
+ */
+bool store_owns(PACKET * pack)
+{
+	return segmentOf(pack) != -1;
+}
+
+/*
+ * Mark the record of a packet in the store as dead.
+ * The packet must not be used afterwards.
+ */
+void store_release(PACKET * pack)
+{
+	int n = segmentOf(pack);
+	RECORDHEADER * r = ((RECORDHEADER *)pack) - 1;
+	if(n == -1 || r->flags != RECORD_LIVE) return;
+	r->flags = RECORD_DEAD;
+	segments[n].liveBytes -= RECORD_SIZE(r->len);
+	segments[n].liveRecords--;
+	if(segments[n].liveRecords == 0 && n != active) dropSegment(n);
+}
+
+/*
+ * Open the store. If recover is set, the segments left by this node
+ * before it rebooted are indexed and admit is called for every live
+ * packet in them. Otherwise any old segments are deleted.
+ *
+ * moved is called whenever compaction moves a packet.
+ */
+void store_init(bool recover, void (*admit)(PACKET * pack),
+	void (*m)(PACKET * from, PACKET * to))
+{
+	mkdir(LOGDIR, 0755);
+	moved = m;
+	active = -1;
+	for(int i=0;i<STORE_MAX_SEGMENTS;i++)
+	{
+		segments[i].base = NULL;
+		if(!recover)
+		{
+			char name[BUFSIZ];
+			segmentName(name, i);
+			unlink(name);
+			continue;
+		}
+		if(!mapSegment(i, false)) continue;
+
+		/*
+		 * walk the record headers, jumping over the packets
+		 */
+		SEGMENT * s = &segments[i];
+		while(s->used + sizeof(RECORDHEADER) <= STORE_SEGMENT_SIZE)
+		{
+			RECORDHEADER * r = (RECORDHEADER *)(s->base + s->used);
+			if(r->magic != STORE_MAGIC
+				|| s->used + RECORD_SIZE(r->len) > STORE_SEGMENT_SIZE) break;
+			if(r->flags == RECORD_LIVE)
+			{
+				s->liveBytes += RECORD_SIZE(r->len);
+				s->liveRecords++;
+			}
+			s->used += RECORD_SIZE(r->len);
+		}
+		if(s->liveRecords == 0)
+		{
+			dropSegment(i);
+			continue;
+		}
+		if(active == -1 || s->used < segments[active].used) active = i;
+	}
+
+	if(!recover) return;
+	for(int i=0;i<STORE_MAX_SEGMENTS;i++)
+	{
+		SEGMENT * s = &segments[i];
+		for(size_t off = 0; s->base != NULL && off < s->used; )
+		{
+			RECORDHEADER * r = (RECORDHEADER *)(s->base + off);
+			off += RECORD_SIZE(r->len);
+			if(r->flags == RECORD_LIVE) admit((PACKET *)(r + 1));
+		}
+	}
+}
@@ -1,14 +1,148 @@
 /* provide a datagram service to the application layer 
  * handles checksums of data
+ *
+ * Messages being reassembled are kept on a queue in order of their
+ * first fragment, and found by (source, msg_num) through an open 
+ * addressing hash table with linear probing.
+ *
+ * Each fragment is copied straight to its place in the message, at
+ * frag_num * MAX_FRAGMENT_SIZE, and marked in a bitmap of received
+ * fragments so that duplicates are dropped.
+ *
+ * A partial message is dropped if it gets no new fragment for
+ * REASSEMBLY_TIMEOUT, or once it is past its deadline. When the buffer
+ * is full, partial messages of the least important class (PRIO_*) are
+ * dropped first, the least complete and then the oldest of those 
+ * first, but never one more important than the new message.
+ *
+ * Each message carries its class, the time it was sent and its 
+ * deadline in every fragment. Fragments arriving past the deadline
+ * are dropped, and the delivery latency of each class is kept.
+ *
+ * With RELIABLE the source keeps a copy of each message of more than
+ * one fragment in a retention buffer of RETAIN_BUFF_SIZE bytes, oldest
+ * dropped first. A destination which has had no new fragment of a 
+ * message for NACK_WAIT sends the source a NACK, a bitmap of the 
+ * fragments it is missing, and the source sends just those again.
+ * A NACK with nothing missing is sent once the message is complete,
+ * so the source can drop its copy.
+ *
+ * With FEC a message of k fragments is sent as n = k + parity_frags(k)
+ * fragments, Reed-Solomon coded (fec.c), and is complete once any k of
+ * them have arrived. Small messages get a larger share of parity than
+ * large ones (fec_tiers). The parity fragments are kept after the data
+ * in the reassembly buffer, and any missing data is rebuilt from them.
+ * The keys of recently completed messages are remembered so that the 
+ * fragments arriving after completion are dropped.
+ *
+ * A fragment is never put together in memory here: its header and its 
+ * slice of the message are passed to net_sendv as two pieces, and the
+ * checksum is a crc32 computed over the pieces in turn.
+ *
+ * With STREAM a message of more than STREAM_WINDOW fragments is 
+ * streamed instead: the source sends at most a window of fragments
+ * past those the destination has confirmed, and the destination writes
+ * each fragment to a spool file in LOGDIR rather than holding the 
+ * message in memory. The window is a share of the message, so a 
+ * message takes about as many round trips whatever its size, capped
+ * so that a resume or a lost path doesn't cost too many copies. The 
+ * destination reports every half window how many fragments it has in
+ * order. If that stops moving for STREAM_WAIT
+ * the source resumes from the last point confirmed, over whatever path
+ * there is then, so a transfer survives a change of path without
+ * starting again. The first resume sends the window again. If that
+ * brings nothing back the path is gone or slow, so later resumes send
+ * just the first fragment not yet confirmed, waiting twice as long 
+ * each time up to STREAM_WAIT << STREAM_BACKOFF. A stream stuck behind
+ * a long store-and-forward path so neither gives up early nor floods
+ * it with copies of its window. A stream is given up when its message
+ * expires, or after STREAM_TRIES resumes if it never does. Streamed 
+ * messages take no parity or NACKs.
+ *
+ * With COALESCE the messages which fit in one fragment are held for up
+ * to COALESCE_DELAY and sent together with the others for the same 
+ * destination as a single batch datagram, each prefixed by its length,
+ * class and creation time. The destination splits the batch up again.
+ * This saves the headers and the link layer handshake of all but one.
  */
 #include "dtn.h"
+#include "fec.h"
 #include <assert.h>
+#include <fcntl.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define TRANSPORT_BUFF_SIZE 1000000
 
+/* initial slots in the reassembly hash table, a power of two */
+#define REASSEMBLY_SLOTS 64
+
+/* bytes of the bitmap for n fragments */
+#define BITMAP_SIZE(n) ((((n) + 31) / 32) * sizeof(uint32_t))
+
+/* bytes of buffer taken up by a message being reassembled */
+#define EL_SIZE(el) (sizeof(struct QUEUE_EL) + (el)->buf_len + \
+	BITMAP_SIZE((el)->num_frags_sent))
+
+/* data fragments in a message of len bytes */
+#define DATA_FRAGS(len) ((int)(((len) + MAX_FRAGMENT_SIZE - 1) / MAX_FRAGMENT_SIZE))
+
+/* keys of completed messages remembered */
+#define DONE_SIZE 256
+
+/* time a partial message waits for its next fragment */
+#define REASSEMBLY_TIMEOUT 120000000
+
+/* interval between checks for timed out partial messages */
+#define REASSEMBLY_SWEEP 5000000
+
+/* bytes of messages kept by the source for retransmission (RELIABLE) */
+#define RETAIN_BUFF_SIZE 1000000
+
+/* time without a new fragment after which the destination NACKs */
+#define NACK_WAIT 30000000
+
+/* most NACKs sent per message */
+#define MAX_NACKS 3
+
+/* fewest parity fragments sent with a coded message (FEC) */
+#define FEC_MIN_PARITY 1
+
+/* 
+ * fragments a streamed message may be ahead of the destination: 
+ * 1/STREAM_SHARE of the message, at least STREAM_WINDOW and at most
+ * STREAM_MAX_WINDOW (STREAM)
+ */
+#define STREAM_WINDOW 4
+#define STREAM_MAX_WINDOW 32
+#define STREAM_SHARE 4
+
+/* 
+ * time without progress after which a stream is first resumed, most
+ * doublings of it for later resumes, and most resumes of a message 
+ * which never expires 
+ */
+#define STREAM_WAIT 15000000
+#define STREAM_BACKOFF 3
+#define STREAM_TRIES 5
+
+/* time a spool is kept without a new fragment, longer than a source tries */
+#define STREAM_IDLE ((STREAM_WAIT << STREAM_BACKOFF) * (STREAM_TRIES + 1))
+
+/* most streamed messages spooled at once */
+#define STREAM_SPOOLS 16
+
+/*
+ * longest a message waits to be sent in a batch (COALESCE). A message
+ * which can't be sent on at once waits for the next beacon anyway
+ */
+#define COALESCE_DELAY ORACLEINTERVAL
+#define EV_COALESCE EV_TIMER4
+
 
 
 /*
@@ -22,18 +156,51 @@
  */
 struct QUEUE_EL
 {
+		/*
+		 * fragments needed to rebuild the message, fragments
+		 * sent by the source, and fragments received
+		 */
 		int num_frags_needed;
+		int num_frags_sent;
 		int num_frags_gotten;
-		long long int key;
-		DATAGRAM* frags;
+		uint64_t key;
+		/*
+		 * the message being rebuilt, and its length. With parity 
+		 * fragments the buffer holds num_frags_sent whole fragments
+		 */
+		char* msg;
+		int msg_len;
+		int buf_len;
+		/*
+		 * bit i is set once fragment i has arrived
+		 */
+		uint32_t* got;
+		/*
+		 * when the partial message is dropped if no new 
+		 * fragment arrives
+		 */
+		CnetTime deadline;
+		/*
+		 * class of the message, when it was sent and when
+		 * it expires
+		 */
+		int prio;
+		CnetTime created;
+		CnetTime expires;
+		/*
+		 * when to NACK the missing fragments, and the 
+		 * number of NACKs sent so far (RELIABLE)
+		 */
+		CnetTime nack_at;
+		int nacks;
 		struct QUEUE_EL* down;
 		struct QUEUE_EL* up;
 };
 
 /*
- * A queue structure that holds arrays of datagrams, one array per 
- * message. Each element also contains information about how many
- * fragments are in its message and how many fragments have been
+ * A queue structure that holds the messages being reassembled. 
+ * Each element also contains information about how many
+ * fragments are in its message and which have been
  * received so far.
  */
 typedef struct 
@@ -48,6 +215,114 @@ typedef struct
  ************************
  */
 
+/*
+ * A message kept by its source for retransmission (RELIABLE)
+ */
+struct RETAINED
+{
+		int msg_num;
+		CnetAddr dest;
+		int prio;
+		CnetTime deadline;
+		char* msg;
+		int len;
+		struct RETAINED* next;
+};
+
+/*
+ * A message being streamed by its source (STREAM)
+ */
+struct STREAMED
+{
+		int msg_num;
+		CnetAddr dest;
+		char* msg;
+		int len;
+		int num_frags;
+		/*
+		 * fragments confirmed by the destination, and fragments sent
+		 */
+		int acked;
+		int sent;
+		int prio;
+		CnetTime created;
+		CnetTime deadline;
+		/*
+		 * when to resume if there is no progress, and the resumes
+		 * since the last progress
+		 */
+		CnetTime resume_at;
+		int tries;
+		struct STREAMED* next;
+};
+
+/*
+ * A batch of small messages for one destination waiting to be
+ * sent (COALESCE)
+ */
+struct BATCH
+{
+		CnetAddr dest;
+		/*
+		 * the records of the messages, and the bytes of them
+		 */
+		char buf[MAX_FRAGMENT_SIZE];
+		int used;
+		/*
+		 * class, creation time and deadline of the batch
+		 */
+		int prio;
+		CnetTime created;
+		CnetTime deadline;
+		/*
+		 * when the batch is sent if it doesn't fill up before
+		 */
+		CnetTime flush_at;
+		struct BATCH* next;
+};
+
+/*
+ * What goes in front of each message in a batch (COALESCE)
+ */
+typedef struct
+{
+		int len;
+		int prio;
+		CnetTime created;
+} BATCHRECORD;
+
+#define BATCH_RECORD_SIZE ((int)sizeof(BATCHRECORD))
+
+/*
+ * A streamed message being written to its spool by its 
+ * destination (STREAM)
+ */
+struct SPOOL
+{
+		uint64_t key;
+		int fd;
+		int num_frags;
+		int msg_len;
+		int num_frags_gotten;
+		/*
+		 * fragments received in order from the start
+		 */
+		int in_order;
+		uint32_t* got;
+		int prio;
+		/*
+		 * when the spool is dropped if no new fragment arrives,
+		 * and when the message expires
+		 */
+		CnetTime deadline;
+		CnetTime expires;
+		/*
+		 * when progress was last reported to the source
+		 */
+		CnetTime reported;
+		struct SPOOL* next;
+};
+
 
 /*
  ********************************
@@ -71,6 +346,125 @@ static int free_bytes;
  */
 static TRANSQUEUE* buff;
 
+/*
+ * hash table of the entries in buff, NULL for a free slot. It has 
+ * num_slots slots, a power of two, and is kept at most half full
+ */
+static struct QUEUE_EL** slots;
+static int num_slots;
+static int num_used;
+
+/*
+ * table for the crc32 of datagrams
+ */
+static uint32_t crc_table[256];
+
+/*
+ * ring of the keys of recently completed messages
+ */
+static uint64_t done[DONE_SIZE];
+static int done_next;
+static int done_count;
+
+/*
+ * reassembly statistics for this node
+ */
+static struct
+{
+		/* messages completed */
+		int completed;
+		/* partial messages dropped after REASSEMBLY_TIMEOUT */
+		int timed_out;
+		/* partial messages dropped to make room */
+		int evicted;
+		/* messages not started for lack of room */
+		int no_room;
+		/* duplicate fragments dropped */
+		int duplicates;
+} reassembly;
+
+/*
+ * messages of each class delivered here and their total latency, and
+ * messages dropped here because they were past their deadline
+ */
+static struct
+{
+		int delivered;
+		CnetTime latency;
+		int expired;
+} classes[NUM_PRIOS];
+
+/*
+ * messages retained for retransmission, oldest first, and the 
+ * space left for them (RELIABLE)
+ */
+static struct RETAINED* retained_head;
+static struct RETAINED* retained_tail;
+static int retain_free_bytes;
+
+/*
+ * retransmission statistics for this node (RELIABLE)
+ */
+static struct
+{
+		/* NACKs sent as destination */
+		int nacks_sent;
+		/* NACKs received as source */
+		int nacks_received;
+		/* ... of which for messages no longer retained */
+		int not_retained;
+		/* fragments sent again */
+		int resent;
+} reliable;
+
+/*
+ * messages being streamed from here, and spooled here (STREAM)
+ */
+static struct STREAMED* streams;
+static struct SPOOL* spools;
+static int num_spools;
+
+/*
+ * batches waiting to be sent, and whether the timer to
+ * send them is running (COALESCE)
+ */
+static struct BATCH* batches;
+static bool coalesce_armed;
+
+/*
+ * whether the network layer shed some of our packets to take a
+ * batch sent by the timer, not yet reported to the application
+ */
+static bool batch_shed;
+
+/*
+ * coalescing statistics for this node (COALESCE)
+ */
+static struct
+{
+		/* messages sent in batches */
+		int messages;
+		/* batches sent */
+		int batches;
+} coalescing;
+
+/*
+ * streaming statistics for this node (STREAM)
+ */
+static struct
+{
+		/* messages streamed as source */
+		int started;
+		/* ... resumed from the last point confirmed */
+		int resumed;
+		/* ... given up */
+		int abandoned;
+		/* messages completed as destination */
+		int completed;
+		/* progress reports sent as destination */
+		int progress_sent;
+} streaming;
+
 
 /*
  ************************
@@ -86,34 +480,92 @@ static TRANSQUEUE* buff;
  */
 
 /*
- * concatenates two ints to make one int
+ * the key of a message: its source in the upper 32 bits and
+ * its number in the lower 32 bits
  */
-static long long int make_key(int src, int message_num)
+static uint64_t make_key(int src, int message_num)
 {
-		char* tmp = malloc(50 * sizeof(char));
-		sprintf(tmp, "%d%d", src * 10000, message_num);
-		long long int ret = atoll(tmp);
-		return ret;
+		return ((uint64_t)(uint32_t)src << 32) | (uint32_t)message_num;
 }
 
 /*
- * Looks up the adress of the entry for the message in the
- * queue
+ * the home slot of key in the hash table
  */
-static struct QUEUE_EL* queue_get(long long int key)
+static int slot_of(uint64_t key)
 {
-		struct QUEUE_EL* curr_el = buff->bottom;
-		if(curr_el == NULL)
+		return (int)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (num_slots - 1);
+}
+
+/*
+ * returns the slot holding key, or the free slot where it belongs
+ */
+static int find_slot(uint64_t key)
+{
+		int i = slot_of(key);
+		while(slots[i] != NULL && slots[i]->key != key)
 		{
-				return NULL;
+				i = (i + 1) & (num_slots - 1);
+		}
+		return i;
+}
+
+/*
+ * Adds an entry to the hash table, doubling the table first if 
+ * that would make it more than half full
+ */
+static void table_add(struct QUEUE_EL* el)
+{
+		if(2 * (num_used + 1) > num_slots)
+		{
+				struct QUEUE_EL** old = slots;
+				int old_size = num_slots;
+				num_slots *= 2;
+				slots = calloc(num_slots, sizeof(struct QUEUE_EL*));
+				for(int i = 0; i < old_size; i++)
+				{
+						if(old[i] != NULL)
+								slots[find_slot(old[i]->key)] = old[i];
+				}
+				free(old);
 		}
-		while(curr_el->up != NULL)
+		slots[find_slot(el->key)] = el;
+		num_used++;
+}
+
+/*
+ * Removes an entry from the hash table. The entries after it in
+ * its run are moved back, so that lookups need no tombstones
+ */
+static void table_remove(struct QUEUE_EL* el)
+{
+		int i = find_slot(el->key);
+		if(slots[i] == NULL)
+				return;
+		slots[i] = NULL;
+		num_used--;
+		for(int j = (i + 1) & (num_slots - 1); slots[j] != NULL; 
+			j = (j + 1) & (num_slots - 1))
 		{
-				if(curr_el->up->key == key)
-						return curr_el->up;
-				curr_el = curr_el->up;
+				/*
+				 * move slots[j] into the hole at i unless its
+				 * home slot lies cyclically in (i, j]
+				 */
+				int home = slot_of(slots[j]->key);
+				if(((j - home) & (num_slots - 1)) < ((j - i) & (num_slots - 1)))
+						continue;
+				slots[i] = slots[j];
+				slots[j] = NULL;
+				i = j;
 		}
-		return NULL;
+}
+
+/*
+ * Looks up the adress of the entry for the message in the
+ * queue
+ */
+static struct QUEUE_EL* queue_get(uint64_t key)
+{
+		return slots[find_slot(key)];
 }	
 
 
@@ -138,62 +590,191 @@ static bool is_empty(TRANSQUEUE* q)
 }
 
 /*
- * Removes the element at the front of the queue.
+ * Frees an element and returns its space to the buffer
+ */
+static void free_el(struct QUEUE_EL* el)
+{
+		free_bytes += EL_SIZE(el);
+		free(el->got);
+		free(el);
+}
+
+/*
+ * Removes an element from the queue and the hash table
  */
-static DATAGRAM* dequeue(TRANSQUEUE* q)
+static void unlink_el(TRANSQUEUE* q, struct QUEUE_EL* el)
 {
-		if(is_empty(q))
+		if(q->bottom == el)
 		{
-				return NULL;
+				q->bottom = el->up;
 		}
-		else
+		if(q->top == el)
 		{
-				struct QUEUE_EL* del = q->bottom;
-				DATAGRAM* d = del->frags;
-				q->bottom = del->up;
-				free(del);
-				if(q->bottom != NULL)
-				{
-						q->bottom->down = NULL;
-				}
-				else
-				{
-						q->top = NULL;
-				}
-				free_bytes += sizeof(struct QUEUE_EL);
-				free_bytes += (d->h.frag_count * sizeof(DATAGRAM));
-				return d;
+				q->top = el->down;
+		}
+		if(el->down != NULL)
+		{
+				el->down->up = el->up;
+		}
+		if(el->up != NULL)
+		{
+				el->up->down = el->down;
+		}
+		table_remove(el);
+}
+
+/*
+ * Removes an element from the queue, dropping the partial message.
+ */
+static void drop_el(TRANSQUEUE* q, struct QUEUE_EL* el)
+{
+		unlink_el(q, el);
+		free(el->msg);
+		free_el(el);
+}
+
+/*
+ * Returns the partial message to drop to make room for a message of
+ * class prio: from the least important class no more important than
+ * prio, the least complete, the oldest one if there are several. 
+ * NULL if there is none
+ */
+static struct QUEUE_EL* least_complete(TRANSQUEUE* q, int prio)
+{
+		struct QUEUE_EL* victim = NULL;
+		for(struct QUEUE_EL* el = q->bottom; el != NULL; el = el->up)
+		{
+				if(el->prio < prio)
+						continue;
+				/*
+				 * compare the shares received without dividing
+				 */
+				if(victim == NULL || el->prio > victim->prio ||
+					(el->prio == victim->prio &&
+					(int64_t)el->num_frags_gotten * victim->num_frags_needed <
+					(int64_t)victim->num_frags_gotten * el->num_frags_needed))
+						victim = el;
+		}
+		return victim;
+}
+
+/*
+ * returns true if the message with this key was completed recently
+ */
+static bool is_done(uint64_t key)
+{
+		for(int i = 0; i < done_count; i++)
+		{
+				if(done[i] == key)
+						return true;
+		}
+		return false;
+}
+
+/*
+ * remember that the message with this key has been completed
+ */
+static void mark_done(uint64_t key)
+{
+		done[done_next] = key;
+		done_next = (done_next + 1) % DONE_SIZE;
+		if(done_count < DONE_SIZE)
+				done_count++;
+}
+
+/*
+ * Rebuilds the missing data fragments of a coded message from its
+ * parity fragments, once any num_frags_needed have arrived. Returns 
+ * false if that is not possible
+ */
+static bool rebuild(struct QUEUE_EL* el)
+{
+		unsigned char* block[FEC_MAX_BLOCKS];
+		bool have[FEC_MAX_BLOCKS];
+		for(int i = 0; i < el->num_frags_sent; i++)
+		{
+				block[i] = (unsigned char*)el->msg + i * MAX_FRAGMENT_SIZE;
+				have[i] = (el->got[i / 32] >> (i % 32)) & 1;
 		}
+		return fec_decode(block, have, el->num_frags_needed, 
+			el->num_frags_sent, MAX_FRAGMENT_SIZE);
 }
 
 /*
  * Put a datagram on the buffer. If it's not part of a message that
- * already has an entry in the buffer, then add a new QUEUE_EL. If 
- * it is part of a message that already has an entry in the buffer, 
- * find the entry and add the datagram to the array for that message. 
+ * already has an entry in the buffer, then add a new QUEUE_EL. 
+ * Copy the fragment to its place in the message, unless it has 
+ * been received already or doesn't fit the message.
  * If this datagram makes up the full message then return true. Else 
  * return false.
  */
 static bool enqueue(TRANSQUEUE* q, DATAGRAM* dat)
 {
-		long long int key = make_key(dat->h.source, dat->h.msg_num);
+		uint64_t key = make_key(dat->h.source, dat->h.msg_num);
 		struct QUEUE_EL* el = queue_get(key);
 		if(el == NULL)
 		{
-				el = malloc(sizeof(struct QUEUE_EL));
-				el->frags = malloc((dat->h.frag_count) * sizeof(DATAGRAM));
+				/*
+				 * a fragment of a message delivered already
+				 */
+				if(is_done(key))
+				{
+						reassembly.duplicates++;
+						return false;
+				}
 
-				int bytes_used = sizeof(struct QUEUE_EL) +  
-						(dat->h.frag_count * sizeof(DATAGRAM));
-				free_bytes -= bytes_used;
+				/*
+				 * the message must need exactly frag_count fragments,
+				 * or fewer if some are parity
+				 */
+				if(dat->h.msg_len <= 0)
+						return false;
+				int k = DATA_FRAGS(dat->h.msg_len);
+				int n = dat->h.frag_count;
+				if(n < k || (n > k && n > FEC_MAX_BLOCKS))
+						return false;
+				int buf_len = (n == k) ? dat->h.msg_len : n * (int)MAX_FRAGMENT_SIZE;
+
+				/*
+				 * make room, dropping the least important and
+				 * least complete partial messages first
+				 */
+				int bytes_used = sizeof(struct QUEUE_EL) + buf_len + 
+					BITMAP_SIZE(n);
 				while(free_bytes < bytes_used)
 				{
-						dequeue(q);
+						struct QUEUE_EL* victim = least_complete(q, dat->h.prio);
+						if(victim == NULL)
+								break;
+						drop_el(q, victim);
+						reassembly.evicted++;
+				}
+				if(free_bytes < bytes_used)
+				{
+						reassembly.no_room++;
+						return false;
 				}
 
-				el->num_frags_needed = dat->h.frag_count;
+				el = malloc(sizeof(struct QUEUE_EL));
+				/*
+				 * zeroed, as the coded last data fragment is padded
+				 */
+				el->msg = (n == k) ? malloc(buf_len) : calloc(1, buf_len);
+				el->got = calloc(1, BITMAP_SIZE(n));
+
+				el->num_frags_needed = k;
+				el->num_frags_sent = n;
 				el->num_frags_gotten = 0;
+				el->msg_len = dat->h.msg_len;
+				el->buf_len = buf_len;
 				el->key = key; 
+				el->deadline = nodeinfo.time_in_usec + REASSEMBLY_TIMEOUT;
+				el->nack_at = nodeinfo.time_in_usec + NACK_WAIT;
+				el->nacks = 0;
+				el->prio = dat->h.prio;
+				el->created = dat->h.created;
+				el->expires = dat->h.deadline;
+				free_bytes -= EL_SIZE(el);
 
 				el->down = q->top;
 				el->up = NULL;
@@ -206,47 +787,53 @@ static bool enqueue(TRANSQUEUE* q, DATAGRAM* dat)
 						q->top->up = el;
 				}
 				q->top = el;
+				table_add(el);
+		}
+		/*
+		 * data fragments go to their place in the message,
+		 * parity fragments after it
+		 */
+		int i = dat->h.frag_num;
+		int offset = i * MAX_FRAGMENT_SIZE;
+		if(dat->h.frag_count != el->num_frags_sent || i < 0 || 
+			i >= el->num_frags_sent || dat->h.msg_len != el->msg_len ||
+			offset + (int)dat->h.msg_size > (i < el->num_frags_needed ? 
+				el->msg_len : el->buf_len) ||
+			(i >= el->num_frags_needed && dat->h.msg_size != MAX_FRAGMENT_SIZE))
+				return false;
+		if(el->got[i / 32] & (1u << (i % 32)))
+		{
+				reassembly.duplicates++;
+				return false;
 		}
-		memcpy(&(el->frags[el->num_frags_gotten]), dat, 
-						DATAGRAM_HEADER_SIZE + dat->h.msg_size);
+		el->got[i / 32] |= 1u << (i % 32);
+		el->deadline = nodeinfo.time_in_usec + REASSEMBLY_TIMEOUT;
+		el->nack_at = nodeinfo.time_in_usec + NACK_WAIT;
+		memcpy(el->msg + offset, dat->msg_frag, dat->h.msg_size);
 		el->num_frags_gotten++;
-		return (el->num_frags_gotten == el->num_frags_needed);
+		if(el->num_frags_gotten < el->num_frags_needed)
+				return false;
+		if(el->num_frags_sent > el->num_frags_needed)
+				return rebuild(el);
+		return true;
 }
 
 
 /*
  * Finds the queue entry for a given message (identified by src
  * and messagenum), removes the entry from the queue and returns
- * the array of datagrams.
+ * the message, which the caller must free.
  */
-static DATAGRAM* queue_delete(TRANSQUEUE* q, int src, int message_num)
+static char* queue_delete(TRANSQUEUE* q, int src, int message_num)
 {
 		struct QUEUE_EL* temp = queue_get(make_key(src, message_num));
 		if (temp == NULL)
 				return NULL;
 		else
 		{
-				if(q->bottom == temp)
-				{
-						q->bottom = temp->up;
-				}
-				if(q->top == temp)
-				{
-						q->top = temp->down;
-				}
-				if(temp->down != NULL)
-				{
-						temp->down->up = temp->up;
-				}
-				if(temp->up != NULL)
-				{
-						temp->up->down = temp->down;
-				}
-
-				free_bytes += (sizeof(struct QUEUE_EL) + 
-								(temp->num_frags_needed * sizeof(DATAGRAM)));
-				DATAGRAM* ret = temp->frags;
-				free(temp);
+				unlink_el(q, temp);
+				char* ret = temp->msg;
+				free_el(temp);
 				return ret;
 		}
 }
@@ -258,37 +845,900 @@ static DATAGRAM* queue_delete(TRANSQUEUE* q, int src, int message_num)
  */
 
 /*
- * Just a comparison function for quick sorting datagrams
+ **********************
+ * CHECKSUM FUNCTIONS *
+ **********************
  */
-static int comp(const void* one, const void* two)
+
+/*
+ * Fills in the table for crc32 (the reflected 0xEDB88320 polynomial)
+ */
+static void crc_init()
 {
-		DATAGRAM* first = (DATAGRAM*) one;
-		DATAGRAM* second = (DATAGRAM*) two;
-		if(first->h.frag_num == second->h.frag_num)
-		{
-				return 0;
-		}
-		else if(first->h.frag_num < second->h.frag_num)
-		{
-				return -1;
-		}
-		else
+		for(uint32_t i = 0; i < 256; i++)
 		{
-				return 1;
+				uint32_t c = i;
+				for(int k = 0; k < 8; k++)
+				{
+						c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+				}
+				crc_table[i] = c;
 		}
 }
 
 /*
- * Called by the network layer.
- *
- * Buffer datagrams until all fragments have arrived, then rebuild
- * the message and pass it to the application layer. If a message
- * has only one fragment, do not buffer it.
- * 
- * If the buffer for this layer fills up, delete all fragments from 
- * the message which received its first fragment the earliest. 
+ * Continues the crc32 crc over len more bytes of data
  */
-void transport_recv(char* msg, int len, CnetAddr sender) 
+static uint32_t crc_update(uint32_t crc, const void* data, size_t len)
+{
+		const unsigned char* p = data;
+		for(size_t i = 0; i < len; i++)
+		{
+				crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+		}
+		return crc;
+}
+
+/*
+ * The checksum of a datagram with header h and h->msg_size bytes of
+ * data, which need not follow the header in memory. It is computed 
+ * as if the checksum field were zero
+ */
+static uint32_t datagram_crc(DATAGRAMHEADER* h, const char* data)
+{
+		DATAGRAMHEADER tmp;
+		memcpy(&tmp, h, sizeof(tmp));
+		tmp.checksum = 0;
+		uint32_t crc = crc_update(0xFFFFFFFF, &tmp, DATAGRAM_HEADER_SIZE);
+		crc = crc_update(crc, data, h->msg_size);
+		return crc ^ 0xFFFFFFFF;
+}
+
+/*
+ * Sets the checksum of the datagram with header h and data, and
+ * sends it to the network layer without copying it together first.
+ * Returns what net_sendv returns
+ */
+static bool send_datagram(DATAGRAMHEADER* h, char* data, CnetAddr destination)
+{
+		h->checksum = datagram_crc(h, data);
+		NETVEC vec[2] = { { (char*)h, DATAGRAM_HEADER_SIZE }, { data, h->msg_size } };
+		assert(DATAGRAM_HEADER_SIZE + h->msg_size <= MAX_DATAGRAM_SIZE);
+		return net_sendv(vec, 2, destination, h->prio, h->deadline);
+}
+
+/*
+ **************************
+ * END CHECKSUM FUNCTIONS *
+ **************************
+ */
+
+/*
+ ****************************
+ * RETRANSMISSION FUNCTIONS *
+ ****************************
+ */
+
+/*
+ * Parity for the data fragments of a message up to the frags'th, as
+ * a percentage of FEC: the first few fragments get more, as losing 
+ * one of them is a larger share of a small message, and the ones
+ * after them less, as the losses of a large message even out
+ */
+static const struct
+{
+		int frags;
+		int scale;
+} fec_tiers[] = { { 4, 200 }, { 16, 150 }, { 64, 100 }, { FEC_MAX_BLOCKS, 75 } };
+
+/*
+ * The parity fragments to send with a message of k data fragments:
+ * the sum of what each of them gets by fec_tiers, rounded up, and at
+ * least FEC_MIN_PARITY
+ */
+static int parity_frags(int k)
+{
+		if(!FEC || k < 2)
+				return 0;
+		int sum = 0;
+		int below = 0;
+		for(int i=0;below < k;i++)
+		{
+				int upto = k < fec_tiers[i].frags ? k : fec_tiers[i].frags;
+				sum += (upto - below) * fec_tiers[i].scale;
+				below = upto;
+		}
+		int m = (sum * FEC + 9999) / 10000;
+		if(m < FEC_MIN_PARITY)
+				m = FEC_MIN_PARITY;
+		if(k + m > FEC_MAX_BLOCKS)
+				m = FEC_MAX_BLOCKS - k;
+		return m > 0 ? m : 0;
+}
+
+/*
+ * Makes parity fragment i of the message msg of length len into out
+ */
+static void make_parity(char* msg, int len, int i, unsigned char* out)
+{
+		int k = DATA_FRAGS(len);
+		unsigned char* data[FEC_MAX_BLOCKS];
+		unsigned char last[MAX_FRAGMENT_SIZE];
+		for(int j = 0; j < k; j++)
+		{
+				data[j] = (unsigned char*)msg + j * MAX_FRAGMENT_SIZE;
+		}
+		/*
+		 * the short last data fragment is coded padded with zeros
+		 */
+		int rest = len - (k - 1) * MAX_FRAGMENT_SIZE;
+		memcpy(last, data[k - 1], rest);
+		memset(last + rest, 0, MAX_FRAGMENT_SIZE - rest);
+		data[k - 1] = last;
+		fec_encode(data, k, i, out, MAX_FRAGMENT_SIZE);
+}
+
+/*
+ * Sends fragment i of the message msg of length len, which has 
+ * num_frags fragments, serial number msg_num, class prio and the
+ * given creation time and deadline, to the network layer. Fragments
+ * past the data are parity. Returns false if the network layer had 
+ * to shed some of our packets
+ */
+static bool send_fragment(char* msg, int len, int i, int num_frags, 
+	int msg_num, int prio, CnetTime created, CnetTime deadline, 
+	CnetAddr destination)
+{
+		/*
+		 * the last data fragment holds what is left over
+		 */
+		int k = DATA_FRAGS(len);
+		int size = MAX_FRAGMENT_SIZE;
+		if(i == k - 1)
+				size = len - i * MAX_FRAGMENT_SIZE;
+
+		DATAGRAMHEADER h;
+		memset(&h, 0, sizeof(h));
+		h.type = DG_DATA;
+		h.msg_size = size;
+		h.source = nodeinfo.nodenumber;
+		h.msg_num = msg_num;
+		h.frag_num = i;
+		h.frag_count = num_frags;
+		h.msg_len = len;
+		h.prio = prio;
+		h.created = created;
+		h.deadline = deadline;
+
+		if(i >= k)
+		{
+				unsigned char parity[MAX_FRAGMENT_SIZE];
+				make_parity(msg, len, i, parity);
+				return send_datagram(&h, (char*)parity, destination);
+		}
+
+		/*
+		 * the slice of the message is sent from where it is
+		 */
+		return send_datagram(&h, &(msg[i * MAX_FRAGMENT_SIZE]), destination);
+}
+
+/*
+ * Keeps a copy of a message for retransmission, dropping the
+ * oldest retained messages if there is not enough room
+ */
+static void retain(char* msg, int len, int msg_num, int prio, 
+	CnetTime deadline, CnetAddr dest)
+{
+		int bytes_used = sizeof(struct RETAINED) + len;
+		if(bytes_used > RETAIN_BUFF_SIZE)
+				return;
+		while(retain_free_bytes < bytes_used)
+		{
+				struct RETAINED* old = retained_head;
+				retained_head = old->next;
+				retain_free_bytes += sizeof(struct RETAINED) + old->len;
+				free(old->msg);
+				free(old);
+		}
+		if(retained_head == NULL)
+				retained_tail = NULL;
+
+		struct RETAINED* r = malloc(sizeof(struct RETAINED));
+		r->msg = malloc(len);
+		memcpy(r->msg, msg, len);
+		r->len = len;
+		r->msg_num = msg_num;
+		r->dest = dest;
+		r->prio = prio;
+		r->deadline = deadline;
+		r->next = NULL;
+		if(retained_tail == NULL)
+				retained_head = r;
+		else
+				retained_tail->next = r;
+		retained_tail = r;
+		retain_free_bytes -= bytes_used;
+}
+
+/*
+ * Sends the source of a message the bitmap of the fragments still 
+ * missing, as a NACK. If el is complete nothing is missing
+ */
+static void send_nack(struct QUEUE_EL* el)
+{
+		int size = BITMAP_SIZE(el->num_frags_sent);
+		DATAGRAMHEADER h;
+		memset(&h, 0, sizeof(h));
+		h.type = DG_NACK;
+		h.msg_size = size;
+		h.source = nodeinfo.nodenumber;
+		h.msg_num = (uint32_t)el->key;
+		h.frag_num = 0;
+		h.frag_count = el->num_frags_sent;
+		h.msg_len = el->msg_len;
+		h.prio = el->prio;
+		h.created = el->created;
+		h.deadline = el->expires;
+
+		/*
+		 * ask for the first fragments missing, as many as are
+		 * still needed to rebuild the message
+		 */
+		uint32_t* missing = calloc(1, size);
+		int wanted = el->num_frags_needed - el->num_frags_gotten;
+		for(int i = 0; i < el->num_frags_sent && wanted > 0; i++)
+		{
+				if(el->got[i / 32] & (1u << (i % 32)))
+						continue;
+				missing[i / 32] |= 1u << (i % 32);
+				wanted--;
+		}
+
+		send_datagram(&h, (char*)missing, (CnetAddr)(el->key >> 32));
+		free(missing);
+		reliable.nacks_sent++;
+}
+
+/*
+ * Handles a NACK from the destination of one of our messages: send
+ * again the fragments it is missing, or drop our copy if it has
+ * them all
+ */
+static void recv_nack(DATAGRAM* d)
+{
+		reliable.nacks_received++;
+		struct RETAINED* prev = NULL;
+		struct RETAINED* r = retained_head;
+		while(r != NULL && !(r->msg_num == d->h.msg_num && r->dest == d->h.source))
+		{
+				prev = r;
+				r = r->next;
+		}
+		int k = DATA_FRAGS(r == NULL ? 1 : r->len);
+		if(r == NULL || d->h.msg_len != r->len || 
+			d->h.frag_count != k + parity_frags(k) ||
+			d->h.msg_size != BITMAP_SIZE(d->h.frag_count))
+		{
+				reliable.not_retained++;
+				return;
+		}
+
+		/*
+		 * an expired message is not worth sending again
+		 */
+		uint32_t* missing = (uint32_t*)d->msg_frag;
+		bool expired = r->deadline != 0 && r->deadline < nodeinfo.time_in_usec;
+		bool complete = true;
+		for(int i = 0; i < d->h.frag_count && !expired; i++)
+		{
+				if(missing[i / 32] & (1u << (i % 32)))
+				{
+						send_fragment(r->msg, r->len, i, d->h.frag_count, 
+							r->msg_num, r->prio, d->h.created, r->deadline, r->dest);
+						reliable.resent++;
+						complete = false;
+				}
+		}
+		if(complete || expired)
+		{
+				if(prev == NULL)
+						retained_head = r->next;
+				else
+						prev->next = r->next;
+				if(retained_tail == r)
+						retained_tail = prev;
+				retain_free_bytes += sizeof(struct RETAINED) + r->len;
+				free(r->msg);
+				free(r);
+		}
+}
+
+/*
+ ********************************
+ * END RETRANSMISSION FUNCTIONS *
+ ********************************
+ */
+
+/*
+ * returns true if a message with this deadline has expired
+ */
+static bool is_expired(CnetTime deadline)
+{
+		return deadline != 0 && deadline < nodeinfo.time_in_usec;
+}
+
+/*
+ * counts the delivery of the message with header h against its class
+ */
+static void delivered(DATAGRAMHEADER* h)
+{
+		classes[h->prio].delivered++;
+		classes[h->prio].latency += nodeinfo.time_in_usec - h->created;
+}
+
+/*
+ ***********************
+ * STREAMING FUNCTIONS *
+ ***********************
+ */
+
+/*
+ * Sends fragment i of a streamed message
+ */
+static bool send_stream_fragment(struct STREAMED* st, int i)
+{
+		int size = MAX_FRAGMENT_SIZE;
+		if(i == st->num_frags - 1)
+				size = st->len - i * MAX_FRAGMENT_SIZE;
+
+		DATAGRAMHEADER h;
+		memset(&h, 0, sizeof(h));
+		h.type = DG_STREAM;
+		h.msg_size = size;
+		h.source = nodeinfo.nodenumber;
+		h.msg_num = st->msg_num;
+		h.frag_num = i;
+		h.frag_count = st->num_frags;
+		h.msg_len = st->len;
+		h.prio = st->prio;
+		h.created = st->created;
+		h.deadline = st->deadline;
+		return send_datagram(&h, &(st->msg[i * MAX_FRAGMENT_SIZE]), st->dest);
+}
+
+/*
+ * fragments a streamed message of num_frags may be ahead of its 
+ * destination. Both ends work it out from the size of the message
+ */
+static int stream_window(int num_frags)
+{
+		int w = num_frags / STREAM_SHARE;
+		if(w < STREAM_WINDOW)
+				w = STREAM_WINDOW;
+		if(w > STREAM_MAX_WINDOW)
+				w = STREAM_MAX_WINDOW;
+		return w;
+}
+
+/*
+ * Sends the fragments of a streamed message which fit in the window
+ * past those confirmed by the destination. Returns false if the
+ * network layer had to shed some of our packets
+ */
+static bool send_window(struct STREAMED* st)
+{
+		bool kept = true;
+		int end = st->acked + stream_window(st->num_frags);
+		if(end > st->num_frags)
+				end = st->num_frags;
+		while(st->sent < end)
+		{
+				kept = send_stream_fragment(st, st->sent) && kept;
+				st->sent++;
+		}
+		return kept;
+}
+
+/*
+ * Removes a streamed message from the list of streams and frees it
+ */
+static void end_stream(struct STREAMED* st)
+{
+		struct STREAMED** p = &streams;
+		while(*p != st)
+				p = &((*p)->next);
+		*p = st->next;
+		free(st->msg);
+		free(st);
+}
+
+/*
+ * Starts streaming a message: a copy is kept until the destination
+ * has confirmed all of it, and the first window is sent
+ */
+static bool start_stream(char* msg, int len, int msg_num, int prio,
+	CnetTime created, CnetTime deadline, CnetAddr destination)
+{
+		struct STREAMED* st = malloc(sizeof(struct STREAMED));
+		st->msg = malloc(len);
+		memcpy(st->msg, msg, len);
+		st->len = len;
+		st->num_frags = DATA_FRAGS(len);
+		st->msg_num = msg_num;
+		st->dest = destination;
+		st->prio = prio;
+		st->created = created;
+		st->deadline = deadline;
+		st->acked = 0;
+		st->sent = 0;
+		st->resume_at = created + STREAM_WAIT;
+		st->tries = 0;
+		st->next = streams;
+		streams = st;
+		streaming.started++;
+		return send_window(st);
+}
+
+/*
+ * Handles a progress report from the destination of one of our
+ * streamed messages: move the window on, or drop our copy once 
+ * all of it has arrived
+ */
+static void recv_progress(DATAGRAM* d)
+{
+		struct STREAMED* st = streams;
+		while(st != NULL && !(st->msg_num == d->h.msg_num && st->dest == d->h.source))
+				st = st->next;
+		if(st == NULL || d->h.frag_num <= st->acked || d->h.frag_num > st->num_frags)
+				return;
+
+		st->acked = d->h.frag_num;
+		if(st->sent < st->acked)
+				st->sent = st->acked;
+		st->tries = 0;
+		st->resume_at = nodeinfo.time_in_usec + STREAM_WAIT;
+		if(st->acked == st->num_frags)
+				end_stream(st);
+		else
+				send_window(st);
+}
+
+/*
+ * Resumes the streams which have made no progress for their wait 
+ * from the first fragment not confirmed, which takes whatever path 
+ * the network layer finds now. The first resume sends the window
+ * again, later ones just that fragment with the rest following once
+ * it is confirmed, and the wait doubles with each. A stream is given
+ * up once it has expired, or after STREAM_TRIES resumes without 
+ * progress if it never expires
+ */
+static void stream_sweep(CnetTime t)
+{
+		struct STREAMED* st = streams;
+		while(st != NULL)
+		{
+				struct STREAMED* next = st->next;
+				if(is_expired(st->deadline) || 
+					(st->deadline == 0 && st->tries >= STREAM_TRIES))
+				{
+						streaming.abandoned++;
+						end_stream(st);
+				}
+				else if(t > st->resume_at)
+				{
+						int shift = st->tries < STREAM_BACKOFF ? st->tries : STREAM_BACKOFF;
+						st->resume_at = t + ((CnetTime)STREAM_WAIT << shift);
+						streaming.resumed++;
+						if(st->tries++ == 0)
+						{
+								st->sent = st->acked;
+								send_window(st);
+						}
+						else
+						{
+								send_stream_fragment(st, st->acked);
+								if(st->sent <= st->acked)
+										st->sent = st->acked + 1;
+						}
+				}
+				st = next;
+		}
+}
+
+/*
+ * Tells the source of a streamed message how many of its fragments
+ * have arrived in order
+ */
+static void send_progress(uint64_t key, int got, int num_frags, int len)
+{
+		DATAGRAMHEADER h;
+		memset(&h, 0, sizeof(h));
+		h.type = DG_PROGRESS;
+		h.msg_size = 0;
+		h.source = nodeinfo.nodenumber;
+		h.msg_num = (uint32_t)key;
+		h.frag_num = got;
+		h.frag_count = num_frags;
+		h.msg_len = len;
+		h.prio = PRIO_HIGH;
+		h.created = nodeinfo.time_in_usec;
+		h.deadline = 0;
+		send_datagram(&h, (char*)"", (CnetAddr)(key >> 32));
+		streaming.progress_sent++;
+}
+
+/*
+ * file name of the spool of the message with this key
+ */
+static void spool_name(char* name, uint64_t key)
+{
+		sprintf(name, "%s/spool-%d-%u-%u", LOGDIR, nodeinfo.nodenumber,
+			(uint32_t)(key >> 32), (uint32_t)key);
+}
+
+/*
+ * Closes and deletes a spool and frees its entry
+ */
+static void drop_spool(struct SPOOL* sp)
+{
+		char name[BUFSIZ];
+		struct SPOOL** p = &spools;
+		while(*p != sp)
+				p = &((*p)->next);
+		*p = sp->next;
+		close(sp->fd);
+		spool_name(name, sp->key);
+		unlink(name);
+		free(sp->got);
+		free(sp);
+		num_spools--;
+}
+
+/*
+ * Starts the spool of a streamed message, NULL if the fragment
+ * doesn't describe one or there are too many spools already
+ */
+static struct SPOOL* new_spool(DATAGRAM* d, uint64_t key)
+{
+		char name[BUFSIZ];
+		if(d->h.msg_len <= 0 || d->h.frag_count != DATA_FRAGS(d->h.msg_len))
+				return NULL;
+		if(num_spools >= STREAM_SPOOLS)
+		{
+				reassembly.no_room++;
+				return NULL;
+		}
+		spool_name(name, key);
+		int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0)
+				return NULL;
+
+		struct SPOOL* sp = malloc(sizeof(struct SPOOL));
+		sp->key = key;
+		sp->fd = fd;
+		sp->num_frags = d->h.frag_count;
+		sp->msg_len = d->h.msg_len;
+		sp->num_frags_gotten = 0;
+		sp->in_order = 0;
+		sp->got = calloc(1, BITMAP_SIZE(sp->num_frags));
+		sp->prio = d->h.prio;
+		sp->deadline = nodeinfo.time_in_usec + STREAM_IDLE;
+		sp->expires = d->h.deadline;
+		sp->reported = nodeinfo.time_in_usec;
+		sp->next = spools;
+		spools = sp;
+		num_spools++;
+		return sp;
+}
+
+/*
+ * Writes a fragment of a streamed message to its spool, and once all
+ * of it is there passes it to the application. Progress is reported
+ * to the source every half window, and again on a duplicate or on the
+ * first fragment after STREAM_WAIT without a report, so that a source
+ * resuming from an old point catches up.
+ */
+static void recv_stream(DATAGRAM* d, CnetAddr sender)
+{
+		uint64_t key = make_key(d->h.source, d->h.msg_num);
+		if(is_done(key))
+		{
+				reassembly.duplicates++;
+				send_progress(key, d->h.frag_count, d->h.frag_count, d->h.msg_len);
+				return;
+		}
+		struct SPOOL* sp = spools;
+		while(sp != NULL && sp->key != key)
+				sp = sp->next;
+		if(sp == NULL && (sp = new_spool(d, key)) == NULL)
+				return;
+
+		int i = d->h.frag_num;
+		if(d->h.frag_count != sp->num_frags || d->h.msg_len != sp->msg_len ||
+			i < 0 || i >= sp->num_frags || d->h.msg_size != (i == sp->num_frags - 1 ?
+				sp->msg_len - i * MAX_FRAGMENT_SIZE : MAX_FRAGMENT_SIZE))
+				return;
+		if(sp->got[i / 32] & (1u << (i % 32)))
+		{
+				reassembly.duplicates++;
+				send_progress(key, sp->in_order, sp->num_frags, sp->msg_len);
+				sp->reported = nodeinfo.time_in_usec;
+				return;
+		}
+		if(pwrite(sp->fd, d->msg_frag, d->h.msg_size, 
+			(off_t)i * MAX_FRAGMENT_SIZE) != (ssize_t)d->h.msg_size)
+				return;
+		sp->got[i / 32] |= 1u << (i % 32);
+		sp->num_frags_gotten++;
+		sp->deadline = nodeinfo.time_in_usec + STREAM_IDLE;
+
+		int before = sp->in_order;
+		while(sp->in_order < sp->num_frags && 
+			(sp->got[sp->in_order / 32] & (1u << (sp->in_order % 32))))
+				sp->in_order++;
+
+		if(sp->num_frags_gotten < sp->num_frags)
+		{
+				int half = stream_window(sp->num_frags) / 2;
+				if(sp->in_order / half != before / half ||
+					nodeinfo.time_in_usec > sp->reported + STREAM_WAIT)
+				{
+						send_progress(key, sp->in_order, sp->num_frags, sp->msg_len);
+						sp->reported = nodeinfo.time_in_usec;
+				}
+				return;
+		}
+
+		/*
+		 * the whole message is in the spool, hand it over
+		 * straight from the file
+		 */
+		send_progress(key, sp->num_frags, sp->num_frags, sp->msg_len);
+		char* msg = mmap(NULL, sp->msg_len, PROT_READ, MAP_PRIVATE, sp->fd, 0);
+		if(msg != MAP_FAILED)
+		{
+				mark_done(key);
+				reassembly.completed++;
+				streaming.completed++;
+				delivered(&d->h);
+				message_receive(msg, sp->msg_len, sender);
+				munmap(msg, sp->msg_len);
+		}
+		drop_spool(sp);
+}
+
+/*
+ * Drops the spools which have timed out or are past their deadline
+ */
+static void spool_sweep(CnetTime t)
+{
+		struct SPOOL* sp = spools;
+		while(sp != NULL)
+		{
+				struct SPOOL* next = sp->next;
+				if(is_expired(sp->expires))
+				{
+						classes[sp->prio].expired++;
+						drop_spool(sp);
+				}
+				else if(t > sp->deadline)
+				{
+						reassembly.timed_out++;
+						drop_spool(sp);
+				}
+				sp = next;
+		}
+}
+
+/*
+ ***************************
+ * END STREAMING FUNCTIONS *
+ ***************************
+ */
+
+/*
+ ************************
+ * COALESCING FUNCTIONS *
+ ************************
+ */
+
+/*
+ * Sends a batch to the network layer as one datagram and frees it.
+ * Returns false if the network layer had to shed some of our packets
+ */
+static bool flush_batch(struct BATCH* b)
+{
+		struct BATCH** p = &batches;
+		while(*p != b)
+				p = &((*p)->next);
+		*p = b->next;
+
+		DATAGRAMHEADER h;
+		memset(&h, 0, sizeof(h));
+		h.type = DG_BATCH;
+		h.msg_size = b->used;
+		h.source = nodeinfo.nodenumber;
+		h.msg_num = ++msg_num_counter;
+		h.frag_num = 0;
+		h.frag_count = 1;
+		h.msg_len = b->used;
+		h.prio = b->prio;
+		h.created = b->created;
+		h.deadline = b->deadline;
+		bool kept = send_datagram(&h, b->buf, b->dest);
+		coalescing.batches++;
+		free(b);
+		return kept;
+}
+
+/*
+ * Sends the batches which have waited COALESCE_DELAY, and waits
+ * for the next one if there are more. Load shed to take them is
+ * reported with the next message from the application
+ */
+static EVENT_HANDLER(coalesce_timeout)
+{
+		CnetTime t = nodeinfo.time_in_usec;
+		CnetTime next = 0;
+		struct BATCH* b = batches;
+		while(b != NULL)
+		{
+				struct BATCH* after = b->next;
+				if(b->flush_at <= t)
+				{
+						if(!flush_batch(b))
+								batch_shed = true;
+				}
+				else if(next == 0 || b->flush_at < next)
+						next = b->flush_at;
+				b = after;
+		}
+		coalesce_armed = next != 0;
+		if(coalesce_armed)
+				CNET_start_timer(EV_COALESCE, next - t, 0);
+}
+
+/*
+ * Adds a message for destination to its batch, starting a new batch
+ * if there is none or it has no room left. A full batch is sent at 
+ * once, any other within COALESCE_DELAY. Returns false if the network
+ * layer had to shed some of our packets to take a batch sent now
+ */
+static bool coalesce(char* msg, int len, int prio, CnetTime created, 
+	CnetTime deadline, CnetAddr destination)
+{
+		bool kept = true;
+		struct BATCH* b = batches;
+		while(b != NULL && b->dest != destination)
+				b = b->next;
+		if(b != NULL && b->used + BATCH_RECORD_SIZE + len > (int)MAX_FRAGMENT_SIZE)
+		{
+				kept = flush_batch(b);
+				b = NULL;
+		}
+		if(b == NULL)
+		{
+				b = malloc(sizeof(struct BATCH));
+				b->dest = destination;
+				b->used = 0;
+				b->prio = prio;
+				b->created = created;
+				b->deadline = deadline;
+				b->flush_at = created + COALESCE_DELAY;
+				b->next = batches;
+				batches = b;
+				if(!coalesce_armed)
+				{
+						CNET_start_timer(EV_COALESCE, COALESCE_DELAY, 0);
+						coalesce_armed = true;
+				}
+		}
+
+		/*
+		 * the batch goes as its most important message, 
+		 * and expires with the first to
+		 */
+		BATCHRECORD r = { len, prio, created };
+		memcpy(b->buf + b->used, &r, BATCH_RECORD_SIZE);
+		memcpy(b->buf + b->used + BATCH_RECORD_SIZE, msg, len);
+		b->used += BATCH_RECORD_SIZE + len;
+		if(prio < b->prio)
+				b->prio = prio;
+		if(deadline != 0 && (b->deadline == 0 || deadline < b->deadline))
+				b->deadline = deadline;
+		coalescing.messages++;
+
+		if(b->used + BATCH_RECORD_SIZE >= (int)MAX_FRAGMENT_SIZE)
+				kept = flush_batch(b) && kept;
+		return kept;
+}
+
+/*
+ * Splits a batch back into its messages and passes each of them to
+ * the application. A batch which doesn't add up is dropped whole
+ */
+static void recv_batch(DATAGRAM* d, CnetAddr sender)
+{
+		int off = 0;
+		while(off < (int)d->h.msg_size)
+		{
+				BATCHRECORD r;
+				if(off + BATCH_RECORD_SIZE > (int)d->h.msg_size)
+						return;
+				memcpy(&r, d->msg_frag + off, BATCH_RECORD_SIZE);
+				if(r.len <= 0 || off + BATCH_RECORD_SIZE + r.len > (int)d->h.msg_size)
+						return;
+				off += BATCH_RECORD_SIZE + r.len;
+		}
+
+		for(off = 0; off < (int)d->h.msg_size; )
+		{
+				BATCHRECORD r;
+				memcpy(&r, d->msg_frag + off, BATCH_RECORD_SIZE);
+				DATAGRAMHEADER h = d->h;
+				h.prio = (r.prio < PRIO_HIGH || r.prio > PRIO_LOW) ? PRIO_LOW : r.prio;
+				h.created = r.created;
+				delivered(&h);
+				message_receive(d->msg_frag + off + BATCH_RECORD_SIZE, r.len, sender);
+				off += BATCH_RECORD_SIZE + r.len;
+		}
+}
+
+/*
+ ****************************
+ * END COALESCING FUNCTIONS *
+ ****************************
+ */
+
+/*
+ * Drops the partial messages which have timed out or are past 
+ * their deadline, and moves the streams along
+ */
+static EVENT_HANDLER(reassembly_sweep)
+{
+		CnetTime t = nodeinfo.time_in_usec;
+		struct QUEUE_EL* el = buff->bottom;
+		while(el != NULL)
+		{
+				struct QUEUE_EL* next = el->up;
+				if(is_expired(el->expires))
+				{
+						classes[el->prio].expired++;
+						drop_el(buff, el);
+				}
+				else if(t > el->deadline)
+				{
+						drop_el(buff, el);
+						reassembly.timed_out++;
+				}
+				else if(RELIABLE && t > el->nack_at && el->nacks < MAX_NACKS)
+				{
+						send_nack(el);
+						el->nacks++;
+						el->nack_at = t + NACK_WAIT;
+				}
+				el = next;
+		}
+		if(STREAM)
+		{
+				stream_sweep(t);
+				spool_sweep(t);
+		}
+		CNET_start_timer(EV_TIMER3, REASSEMBLY_SWEEP, 0);
+}
+
+/*
+ * Called by the network layer.
+ *
+ * Buffer datagrams until all fragments have arrived, then rebuild
+ * the message and pass it to the application layer. If a message
+ * has only one fragment, do not buffer it.
+ * 
+ * If the buffer for this layer fills up, delete all fragments from 
+ * the message which received its first fragment the earliest. 
+ */
+void transport_recv(char* msg, int len, CnetAddr sender) 
 {
 
 		DATAGRAM * d = (DATAGRAM*) msg;
@@ -296,19 +1746,54 @@ void transport_recv(char* msg, int len, CnetAddr sender)
 		/* 
 		 * Check integrity 
 		 */
-		int oldsum = d->h.checksum;
-		d->h.checksum = 0;
-		int sum = CNET_crc32((unsigned char *)(d), len);
-		if(sum != oldsum) {
+		if(len < (int)DATAGRAM_HEADER_SIZE || 
+			d->h.msg_size != len - DATAGRAM_HEADER_SIZE)
+				return;
+		if(datagram_crc(&d->h, d->msg_frag) != d->h.checksum) {
 				return;
 		}
 
 
+		if(d->h.type == DG_NACK)
+		{
+				if(RELIABLE)
+						recv_nack(d);
+				return;
+		}
+		if(d->h.type == DG_PROGRESS)
+		{
+				if(STREAM)
+						recv_progress(d);
+				return;
+		}
+
+		/*
+		 * a class we don't know is the least important
+		 */
+		if(d->h.prio < PRIO_HIGH || d->h.prio > PRIO_LOW)
+				d->h.prio = PRIO_LOW;
+		if(is_expired(d->h.deadline))
+		{
+				classes[d->h.prio].expired++;
+				return;
+		}
+
 		/* 
 		 * Pass up 
 		 */
-		if(d->h.frag_count == 1)
+		if(d->h.type == DG_STREAM)
 		{
+				if(STREAM)
+						recv_stream(d, sender);
+		}
+		else if(d->h.type == DG_BATCH)
+		{
+				if(COALESCE)
+						recv_batch(d, sender);
+		}
+		else if(d->h.frag_count == 1)
+		{
+				delivered(&d->h);
 				message_receive(d->msg_frag, d->h.msg_size, sender);
 		}
 		else
@@ -317,26 +1802,24 @@ void transport_recv(char* msg, int len, CnetAddr sender)
 				if(all_received == true)
 				{
 						/*
-						 * Reassemble message
+						 * The fragments are already in place, 
+						 * send the message to the application layer
 						 */
-						DATAGRAM* frags = queue_delete(buff, d->h.source, d->h.msg_num);
-						qsort(frags, d->h.frag_count, sizeof(DATAGRAM), comp);
-						int num_frags = d->h.frag_count;
-						char* built_msg = 
-								malloc(num_frags * MAX_FRAGMENT_SIZE * sizeof(char));
-						int built_msg_size = 0;
-						for(int i = 0; i < num_frags; i++)
+						if(RELIABLE)
 						{
-								memcpy(built_msg + (i * MAX_FRAGMENT_SIZE), 
-												frags[i].msg_frag, frags[i].h.msg_size);
-								built_msg_size += frags[i].h.msg_size;
+								/*
+								 * tell the source it can drop its copy
+								 */
+								struct QUEUE_EL* el = 
+									queue_get(make_key(d->h.source, d->h.msg_num));
+								send_nack(el);
 						}
-						/*
-						 * Send the message to the application layer
-						 */
-						message_receive(built_msg, built_msg_size, sender);
+						char* built_msg = queue_delete(buff, d->h.source, d->h.msg_num);
+						mark_done(make_key(d->h.source, d->h.msg_num));
+						reassembly.completed++;
+						delivered(&d->h);
+						message_receive(built_msg, d->h.msg_len, sender);
 						free(built_msg);
-						free(frags);
 				}
 		}
 }
@@ -345,9 +1828,15 @@ void transport_recv(char* msg, int len, CnetAddr sender)
  * Called by the application layer. Receives a message originating at this node,
  * fragments it if necessary, computes the checksum, builds the header so that
  * error checking and reassembly of fragments is possible and sends it to the
- * network layer.
+ * network layer. The message is of class prio and is dropped anywhere it is
+ * found after deadline, unless that is 0.
+ *
+ * Returns false if the network layer had to shed some of our own packets
+ * to take the fragments, or a batch sent since the last message, a sign
+ * that the application should slow down.
  */
-void transport_datagram(char* msg, int len, CnetAddr destination) 
+bool transport_datagram(char* msg, int len, CnetAddr destination, int prio,
+	CnetTime deadline) 
 {
 		/*
 		 * Determine how many fragments will be needed
@@ -358,89 +1847,71 @@ void transport_datagram(char* msg, int len, CnetAddr destination)
 		else
 				extra = 1;
 		int num_frags_needed = (len / MAX_FRAGMENT_SIZE) + extra;
+		int num_frags = num_frags_needed + parity_frags(num_frags_needed);
 
-		int src = nodeinfo.nodenumber;
 		int msg_num = ++msg_num_counter;
-		int frag_num = 0;
+		CnetTime created = nodeinfo.time_in_usec;
+
+		/*
+		 * load shed for a batch sent since the last message
+		 */
+		bool shed = batch_shed;
+		batch_shed = false;
+		if(STREAM && num_frags_needed > STREAM_WINDOW)
+				return start_stream(msg, len, msg_num, prio, created, deadline,
+					destination) && !shed;
+		if(COALESCE && len + BATCH_RECORD_SIZE <= (int)MAX_FRAGMENT_SIZE)
+				return coalesce(msg, len, prio, created, deadline, destination) 
+					&& !shed;
+		if(RELIABLE && num_frags_needed > 1)
+				retain(msg, len, msg_num, prio, deadline, destination);
+
 		/*
 		 * Break the message into fragments
 		 */
-		for(int i = 0; i < num_frags_needed; i++) 
+		bool kept = true;
+		for(int i = 0; i < num_frags; i++) 
 		{
-				/*
-				 * if it is the last fragment of the message:
-				 */
-				if((i == num_frags_needed - 1)) 
-				{ 
-						int remainder = len % MAX_FRAGMENT_SIZE;
-						if (remainder == 0)
-								remainder = MAX_FRAGMENT_SIZE;
-
-						/*
-						 * Make a new datagram
-						 */
-						DATAGRAM* d = malloc(DATAGRAM_HEADER_SIZE + remainder); 
-						d->h.msg_size = remainder;
-						d->h.source = src;
-						d->h.msg_num = msg_num;
-						d->h.frag_num = frag_num++;
-						d->h.frag_count = num_frags_needed;
-						/*
-						 * copy over a part of a the message. 
-						 */
-						memcpy(d->msg_frag, &(msg[i * MAX_FRAGMENT_SIZE]), remainder);
-
-						/*
-						 * Set the checksum
-						 */
-						d->h.checksum = 0;
-						d->h.checksum = CNET_crc32(((unsigned char *) d), 
-										DATAGRAM_HEADER_SIZE + d->h.msg_size); 
-
-						/*
-						 * Send it and free the memory
-						 */
-						assert(DATAGRAM_HEADER_SIZE + remainder < MAX_PACKET_SIZE);
-						net_send(((char*) d), 
-										DATAGRAM_HEADER_SIZE + remainder, destination);
-						free(d);
-				}
-				/*
-				 * if it's not the last fragment of the message:
-				 */
-				else 
-				{
-						/*
-						 * Make a new datagram
-						 */
-						DATAGRAM* d = malloc(sizeof(DATAGRAM));
-
-						d->h.msg_size = MAX_FRAGMENT_SIZE;
-						d->h.source = src;
-						d->h.msg_num = msg_num;
-						d->h.frag_num = frag_num++;
-						d->h.frag_count = num_frags_needed;
-
-						/*
-						 * copy over a part of a the message. 
-						 */
-						memcpy(d->msg_frag, &(msg[i * MAX_FRAGMENT_SIZE]),
-										MAX_FRAGMENT_SIZE);
-
-						/*
-						 * Set the checksum
-						 */
-						d->h.checksum = 0;
-						d->h.checksum = CNET_crc32(((unsigned char *) d), 
-										DATAGRAM_HEADER_SIZE + d->h.msg_size); 
+				kept = send_fragment(msg, len, i, num_frags, msg_num, prio, 
+					created, deadline, destination) && kept;
+		}
+		return kept && !shed;
+}
 
-						assert(sizeof(DATAGRAM) <= MAX_DATAGRAM_SIZE);
-						/*
-						 * Send it. Free memeory
-						 */
-						net_send(((char*)d), sizeof(DATAGRAM), destination);
-						free(d);
-				}
+/*
+ * Print the reassembly statistics of this node
+ */
+void transport_report()
+{
+		printf("node %d reassembly: completed %d, partial messages timed out %d "
+			"evicted %d, not started for lack of room %d, duplicate fragments %d\n",
+			nodeinfo.nodenumber, reassembly.completed, reassembly.timed_out,
+			reassembly.evicted, reassembly.no_room, reassembly.duplicates);
+		for(int c = PRIO_HIGH; c <= PRIO_LOW; c++)
+		{
+				printf("node %d class %d messages: delivered %d, total latency "
+					"%lld usec, expired %d\n", nodeinfo.nodenumber, c, 
+					classes[c].delivered, (long long)classes[c].latency, 
+					classes[c].expired);
+		}
+		if(RELIABLE)
+		{
+				printf("node %d retransmission: NACKs sent %d received %d "
+					"(for messages no longer kept %d), fragments resent %d\n",
+					nodeinfo.nodenumber, reliable.nacks_sent, 
+					reliable.nacks_received, reliable.not_retained, reliable.resent);
+		}
+		if(COALESCE)
+		{
+				printf("node %d coalescing: messages %d sent in %d batches\n",
+					nodeinfo.nodenumber, coalescing.messages, coalescing.batches);
+		}
+		if(STREAM)
+		{
+				printf("node %d streaming: started %d, resumed %d, given up %d, "
+					"completed %d, progress reports sent %d\n", nodeinfo.nodenumber,
+					streaming.started, streaming.resumed, streaming.abandoned,
+					streaming.completed, streaming.progress_sent);
 		}
 }
 
@@ -455,4 +1926,31 @@ void transport_init()
 		msg_num_counter = 0;	
 		free_bytes = TRANSPORT_BUFF_SIZE;
 		buff = new_queue();
+		crc_init();
+		if(FEC)
+				fec_init();
+		done_next = 0;
+		done_count = 0;
+		num_slots = REASSEMBLY_SLOTS;
+		num_used = 0;
+		slots = calloc(num_slots, sizeof(struct QUEUE_EL*));
+		memset(&reassembly, 0, sizeof(reassembly));
+		memset(classes, 0, sizeof(classes));
+		retained_head = NULL;
+		retained_tail = NULL;
+		retain_free_bytes = RETAIN_BUFF_SIZE;
+		memset(&reliable, 0, sizeof(reliable));
+		streams = NULL;
+		spools = NULL;
+		num_spools = 0;
+		memset(&streaming, 0, sizeof(streaming));
+		batches = NULL;
+		coalesce_armed = false;
+		memset(&coalescing, 0, sizeof(coalescing));
+		if(COALESCE)
+				CHECK(CNET_set_handler(EV_COALESCE, coalesce_timeout, 0));
+		if(STREAM)
+				mkdir(LOGDIR, 0755);
+		CHECK(CNET_set_handler(EV_TIMER3, reassembly_sweep, 0));
+		CNET_start_timer(EV_TIMER3, REASSEMBLY_SWEEP, 0);
 }